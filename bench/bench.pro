@@ -0,0 +1,22 @@
+QT = core network
+
+TARGET = nubbock-bench
+CONFIG += console link_pkgconfig
+CONFIG -= app_bundle
+PKGCONFIG += wayland-client
+# For the control socket's binary encoding
+INCLUDEPATH += ..
+
+HEADERS += \
+    benchmark.h \
+    syntheticwindow.h \
+    surfacechurner.h \
+    controlclient.h \
+    touchreplayer.h
+
+SOURCES += main.cpp \
+    benchmark.cpp \
+    syntheticwindow.cpp \
+    surfacechurner.cpp \
+    controlclient.cpp \
+    touchreplayer.cpp
@@ -0,0 +1,498 @@
+#include "benchmark.h"
+#include "surfacechurner.h"
+#include "touchreplayer.h"
+
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QDebug>
+#include <QtMath>
+#include <algorithm>
+#include <cstdio>
+
+// Attempts, 100 ms apart, to reach the compositor after starting it
+static const int maxConnectAttempts = 100;
+// Commands each control socket client sends before waiting for a reply
+static const int controlBatchSize = 100;
+
+const char *const BenchmarkConfig::scenarioNames[BenchmarkConfig::ScenarioCount] = {
+    "frames", "surfaces", "control", "touch", "hittest"
+};
+
+// Same fields as the compositor's histograms, in microseconds
+static QJsonObject summarize(QVector<qint64> samples)
+{
+    QJsonObject obj;
+    obj["count"] = samples.count();
+    if (samples.isEmpty())
+        return obj;
+
+    std::sort(samples.begin(), samples.end());
+
+    qint64 sum = 0;
+    for (qint64 sample : qAsConst(samples))
+        sum += sample;
+
+    const auto percentile = [&samples](qreal fraction) {
+        const int rank = qMax(1, qCeil(fraction * samples.count()));
+        return double(samples.at(rank - 1) / 1000);
+    };
+
+    obj["mean"] = double(sum / samples.count() / 1000);
+    obj["max"] = double(samples.last() / 1000);
+    obj["p50"] = percentile(0.5);
+    obj["p90"] = percentile(0.9);
+    obj["p99"] = percentile(0.99);
+    return obj;
+}
+
+Benchmark::Benchmark(const BenchmarkConfig &config, QObject *parent)
+    : QObject(parent)
+    , m_config(config)
+    , m_churner(nullptr)
+    , m_touchReplayer(nullptr)
+    , m_controlEncoding(ControlClient::JsonEncoding)
+    , m_windowsCreated(0)
+    , m_windowsCreatedBefore(0)
+    , m_connectAttempts(0)
+    , m_done(false)
+    , m_viewsAllocatedBefore(0)
+    , m_viewsReusedBefore(0)
+    , m_retiredCommits(0)
+    , m_retiredSkippedCommits(0)
+    , m_retiredFrames(0)
+{
+    connect(&m_connectTimer, &QTimer::timeout, this, &Benchmark::connectWindows);
+    connect(&m_churnTimer, &QTimer::timeout, this, &Benchmark::churn);
+
+    connect(&m_process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
+            this, [this]() {
+        fail(QStringLiteral("Compositor exited"));
+    });
+}
+
+Benchmark::~Benchmark()
+{
+    stopCompositor();
+}
+
+void Benchmark::start()
+{
+    const QString runtimeDir = QString::fromLocal8Bit(qgetenv("XDG_RUNTIME_DIR"));
+    if (runtimeDir.isEmpty()) {
+        fail(QStringLiteral("XDG_RUNTIME_DIR is not set"));
+        return;
+    }
+
+    const QString name = QStringLiteral("nubbock-bench-%1").arg(QCoreApplication::applicationPid());
+    m_socketName = name.toLocal8Bit();
+    m_controlPath = runtimeDir + QLatin1Char('/') + name + QStringLiteral(".control");
+
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert(QStringLiteral("QT_QPA_PLATFORM"), m_config.platform);
+    // The compositor talks to EGL directly, which xcb only uses when asked
+    if (m_config.platform == QLatin1String("xcb"))
+        env.insert(QStringLiteral("QT_XCB_GL_INTEGRATION"), QStringLiteral("xcb_egl"));
+    env.insert(QStringLiteral("NUBBOCK_SOCKET"), m_controlPath);
+    if (m_config.softwareGl)
+        env.insert(QStringLiteral("LIBGL_ALWAYS_SOFTWARE"), QStringLiteral("1"));
+
+    if (m_config.scenario == BenchmarkConfig::TouchScenario
+            || m_config.scenario == BenchmarkConfig::HitTestScenario) {
+        const QString touchPath = runtimeDir + QLatin1Char('/') + name + QStringLiteral(".touch");
+        const TouchReplayer::Pattern pattern = m_config.scenario == BenchmarkConfig::HitTestScenario
+                ? TouchReplayer::TapPattern : TouchReplayer::GesturePattern;
+        m_touchReplayer = new TouchReplayer(touchPath, pattern, m_config.fingers, this);
+        if (!m_touchReplayer->create()) {
+            fail(QStringLiteral("Failed to create the touch FIFO"));
+            return;
+        }
+        env.insert(QStringLiteral("NUBBOCK_EVDEV_DEVICES"), touchPath);
+    }
+
+    m_process.setProcessEnvironment(env);
+    m_process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    m_process.setStandardOutputFile(QProcess::nullDevice());
+    m_process.start(m_config.compositor, QStringList() << QStringLiteral("--wayland-socket-name") << name);
+    if (!m_process.waitForStarted()) {
+        fail(QStringLiteral("Failed to start ") + m_config.compositor);
+        return;
+    }
+
+    m_connectTimer.start(100);
+}
+
+// The first window polls for the compositor to come up, the others
+// follow right away
+void Benchmark::connectWindows()
+{
+    if (!createWindow()) {
+        if (++m_connectAttempts >= maxConnectAttempts)
+            fail(QStringLiteral("Could not connect to the compositor"));
+        return;
+    }
+
+    m_connectTimer.stop();
+
+    while (m_windows.count() < m_config.windows) {
+        if (!createWindow()) {
+            fail(QStringLiteral("Could not connect window to the compositor"));
+            return;
+        }
+    }
+
+    if (m_config.scenario == BenchmarkConfig::SurfacesScenario) {
+        m_churner = new SurfaceChurner(m_config.subsurfaceDepth, this);
+        if (!m_churner->connectTo(m_socketName)) {
+            fail(QStringLiteral("Could not connect the surface churner to the compositor"));
+            return;
+        }
+        connect(m_churner, &SurfaceChurner::failed, this, [this]() {
+            fail(QStringLiteral("The surface churner lost its connection"));
+        });
+        m_churner->start();
+    }
+
+    QTimer::singleShot(m_config.warmup * 1000, this, &Benchmark::startMeasuring);
+}
+
+SyntheticWindow *Benchmark::createWindow()
+{
+    WindowConfig config;
+    config.size = m_config.sizes.at(m_windowsCreated % m_config.sizes.count());
+    config.commitRate = m_config.commitRate;
+    config.damage = m_config.damage;
+    config.subsurfaceDepth = m_config.subsurfaceDepth;
+    config.tiles = m_config.tiles;
+
+    SyntheticWindow *window = new SyntheticWindow(config, this);
+    if (!window->connectTo(m_socketName)) {
+        delete window;
+        return nullptr;
+    }
+
+    connect(window, &SyntheticWindow::failed, this, [this]() {
+        fail(QStringLiteral("A synthetic window lost its connection"));
+    });
+
+    window->start();
+    m_windows.append(window);
+    m_windowsCreated++;
+    return window;
+}
+
+void Benchmark::startMeasuring()
+{
+    if (m_done)
+        return;
+
+    QJsonObject stats;
+    if (!queryStats(true, &stats)) {
+        fail(QStringLiteral("Failed to reset the compositor's statistics"));
+        return;
+    }
+
+    for (SyntheticWindow *window : qAsConst(m_windows))
+        window->resetCounters();
+    m_windowsCreatedBefore = m_windowsCreated;
+
+    // These are not reset with the histograms
+    const QJsonObject views = stats.value(QLatin1String("views")).toObject();
+    m_viewsAllocatedBefore = views.value(QLatin1String("allocated")).toDouble();
+    m_viewsReusedBefore = views.value(QLatin1String("reused")).toDouble();
+    if (m_churner)
+        m_churner->resetCounters();
+
+    // The compositor opens its input devices once its window is up, by
+    // now it has
+    if (m_touchReplayer) {
+        if (!m_touchReplayer->open()) {
+            fail(QStringLiteral("The compositor did not open the touch FIFO"));
+            return;
+        }
+        m_touchReplayer->start();
+    }
+
+    m_elapsed.start();
+    if (m_config.scenario == BenchmarkConfig::ControlScenario) {
+        startControlClients(ControlClient::JsonEncoding);
+        QTimer::singleShot(m_config.duration * 500, this, &Benchmark::switchControlEncoding);
+    }
+    if (m_config.churnInterval > 0)
+        m_churnTimer.start(m_config.churnInterval);
+    QTimer::singleShot(m_config.duration * 1000, this, &Benchmark::finish);
+}
+
+// Replaces the oldest window, which destroys all of its surfaces and
+// creates new ones in their place
+void Benchmark::churn()
+{
+    SyntheticWindow *window = m_windows.takeFirst();
+    m_retiredCommits += window->commits();
+    m_retiredSkippedCommits += window->skippedCommits();
+    m_retiredFrames += window->frames();
+    m_retiredLatencies += window->latencies();
+    delete window;
+
+    if (!createWindow())
+        fail(QStringLiteral("Could not connect window to the compositor"));
+}
+
+void Benchmark::startControlClients(ControlClient::Encoding encoding)
+{
+    m_controlEncoding = encoding;
+    m_controlElapsed.start();
+
+    for (int i = 0; i < m_config.connections; i++) {
+        ControlClient *client = new ControlClient(encoding, controlBatchSize, this);
+        m_controlClients.append(client);
+        if (!client->connectTo(m_controlPath)) {
+            fail(QStringLiteral("Could not connect to the control socket"));
+            return;
+        }
+
+        connect(client, &ControlClient::failed, this, [this]() {
+            fail(QStringLiteral("A control socket client lost its connection"));
+        });
+        client->start();
+    }
+}
+
+// The encoding is picked per connection, so the binary half of the
+// measurement runs over fresh ones
+void Benchmark::switchControlEncoding()
+{
+    if (m_done)
+        return;
+
+    finishControlPhase();
+    startControlClients(ControlClient::BinaryEncoding);
+}
+
+void Benchmark::finishControlPhase()
+{
+    const double seconds = m_controlElapsed.nsecsElapsed() / 1e9;
+
+    quint64 messages = 0;
+    QVector<qint64> batchTimes;
+    for (const ControlClient *client : qAsConst(m_controlClients)) {
+        messages += client->messages();
+        batchTimes += client->batchTimes();
+    }
+
+    qDeleteAll(m_controlClients);
+    m_controlClients.clear();
+
+    QJsonObject phase;
+    phase["duration"] = seconds;
+    phase["messages"] = double(messages);
+    phase["messagesPerSecond"] = messages / seconds;
+    phase["batchTime"] = summarize(batchTimes);
+    m_controlPhases[QLatin1String(ControlClient::encodingNames[m_controlEncoding])] = phase;
+}
+
+void Benchmark::finish()
+{
+    if (m_done)
+        return;
+
+    m_churnTimer.stop();
+    if (!m_controlClients.isEmpty())
+        finishControlPhase();
+
+    QJsonObject stats;
+    if (!queryStats(false, &stats)) {
+        fail(QStringLiteral("Failed to query the compositor's statistics"));
+        return;
+    }
+
+    const QByteArray json = QJsonDocument(report(stats)).toJson();
+    fwrite(json.constData(), 1, size_t(json.size()), stdout);
+    fflush(stdout);
+
+    m_done = true;
+    stopCompositor();
+    emit finished(0);
+}
+
+void Benchmark::fail(const QString &error)
+{
+    if (m_done)
+        return;
+
+    qWarning().noquote() << error;
+    m_done = true;
+    stopCompositor();
+    emit finished(1);
+}
+
+void Benchmark::stopCompositor()
+{
+    m_connectTimer.stop();
+    m_churnTimer.stop();
+    qDeleteAll(m_windows);
+    m_windows.clear();
+    delete m_churner;
+    m_churner = nullptr;
+    delete m_touchReplayer;
+    m_touchReplayer = nullptr;
+    qDeleteAll(m_controlClients);
+    m_controlClients.clear();
+
+    if (m_process.state() == QProcess::NotRunning)
+        return;
+
+    m_process.blockSignals(true);
+    m_process.terminate();
+    if (!m_process.waitForFinished(5000))
+        m_process.kill();
+}
+
+// Blocks until the compositor replied. Frame callbacks arriving in the
+// meantime are handled afterwards.
+bool Benchmark::queryStats(bool reset, QJsonObject *stats)
+{
+    if (m_control.state() != QLocalSocket::ConnectedState) {
+        m_control.connectToServer(m_controlPath);
+        if (!m_control.waitForConnected(5000))
+            return false;
+    }
+
+    QJsonObject query;
+    query["query"] = QStringLiteral("stats");
+    if (reset)
+        query["reset"] = true;
+    m_control.write(QJsonDocument(query).toJson(QJsonDocument::Compact) + '\0');
+
+    QByteArray reply;
+    while (!reply.contains('\0')) {
+        if (!m_control.waitForReadyRead(5000))
+            return false;
+        reply += m_control.readAll();
+    }
+    reply.truncate(reply.indexOf('\0'));
+
+    const QJsonObject obj = QJsonDocument::fromJson(reply).object();
+    if (!obj.contains(QLatin1String("stats")))
+        return false;
+
+    *stats = obj.value(QLatin1String("stats")).toObject();
+    return true;
+}
+
+QJsonObject Benchmark::report(const QJsonObject &stats) const
+{
+    const double seconds = m_elapsed.nsecsElapsed() / 1e9;
+
+    QJsonArray sizes;
+    for (const QSize &size : m_config.sizes)
+        sizes.append(QStringLiteral("%1x%2").arg(size.width()).arg(size.height()));
+
+    QJsonObject config;
+    config["scenario"] = QLatin1String(BenchmarkConfig::scenarioNames[m_config.scenario]);
+    config["platform"] = m_config.platform;
+    config["softwareGl"] = m_config.softwareGl;
+    config["windows"] = m_config.windows;
+    config["sizes"] = sizes;
+    config["commitRate"] = m_config.commitRate;
+    config["damage"] = QLatin1String(WindowConfig::damageNames[m_config.damage]);
+    config["subsurfaceDepth"] = m_config.subsurfaceDepth;
+    config["tiles"] = m_config.tiles;
+    config["churnInterval"] = m_config.churnInterval;
+    config["connections"] = m_config.connections;
+    config["fingers"] = m_config.fingers;
+
+    QJsonObject compositor;
+    compositor["framesPerSecond"] = stats.value(QLatin1String("frame")).toObject().value(QLatin1String("count")).toDouble() / seconds;
+    compositor["paint"] = stats.value(QLatin1String("frame"));
+    compositor["upload"] = stats.value(QLatin1String("upload"));
+    compositor["render"] = stats.value(QLatin1String("render"));
+    compositor["gpu"] = stats.value(QLatin1String("gpu"));
+    compositor["commitToPresent"] = stats.value(QLatin1String("latency"));
+    compositor["missedFrames"] = stats.value(QLatin1String("missedFrames"));
+    // Both are about the last frame only
+    compositor["culledViews"] = stats.value(QLatin1String("culledViews"));
+    compositor["throttledSurfaces"] = stats.value(QLatin1String("throttledSurfaces"));
+    compositor["memory"] = stats.value(QLatin1String("memory"));
+
+    // Views for new surfaces, either freshly allocated or taken from the pool
+    const QJsonObject views = stats.value(QLatin1String("views")).toObject();
+    const double viewsAllocated = views.value(QLatin1String("allocated")).toDouble() - m_viewsAllocatedBefore;
+    const double viewsReused = views.value(QLatin1String("reused")).toDouble() - m_viewsReusedBefore;
+    QJsonObject viewsCreated;
+    viewsCreated["allocated"] = viewsAllocated;
+    viewsCreated["reused"] = viewsReused;
+    viewsCreated["live"] = views.value(QLatin1String("live"));
+    compositor["views"] = viewsCreated;
+
+    quint64 commits = m_retiredCommits;
+    quint64 skippedCommits = m_retiredSkippedCommits;
+    quint64 frames = m_retiredFrames;
+    QVector<qint64> latencies = m_retiredLatencies;
+    for (const SyntheticWindow *window : m_windows) {
+        commits += window->commits();
+        skippedCommits += window->skippedCommits();
+        frames += window->frames();
+        latencies += window->latencies();
+    }
+
+    QJsonObject clients;
+    clients["commits"] = double(commits);
+    clients["skippedCommits"] = double(skippedCommits);
+    clients["frames"] = double(frames);
+    clients["framesPerSecond"] = frames / seconds / m_config.windows;
+    clients["windowsCreated"] = m_windowsCreated - m_windowsCreatedBefore;
+    clients["commitToFrameCallback"] = summarize(latencies);
+
+    QJsonObject result;
+    result["config"] = config;
+    result["duration"] = seconds;
+    result["compositor"] = compositor;
+    result["clients"] = clients;
+
+    // The windows created meanwhile account for the views that the
+    // cycles did not create
+    if (m_churner) {
+        const quint64 cycles = m_churner->cycles();
+        const double surfacesCreated = double(cycles) * m_churner->surfacesPerCycle()
+                + double(m_windowsCreated - m_windowsCreatedBefore) * (m_config.subsurfaceDepth + m_config.tiles + 1);
+
+        QJsonObject surfaces;
+        surfaces["cycles"] = double(cycles);
+        surfaces["cyclesPerSecond"] = cycles / seconds;
+        surfaces["cycleTime"] = summarize(m_churner->cycleTimes());
+        surfaces["viewAllocationsPerSurface"] = surfacesCreated > 0 ? viewsAllocated / surfacesCreated : 0.0;
+        surfaces["viewReusesPerSurface"] = surfacesCreated > 0 ? viewsReused / surfacesCreated : 0.0;
+        result["surfaces"] = surfaces;
+    }
+
+    // Touch events are routed right away once a finger goes down or up,
+    // motion is coalesced into one event per frame. Only going down
+    // hit-tests, so taps measure hit-testing.
+    if (m_touchReplayer) {
+        QJsonObject touch;
+        touch["frames"] = double(m_touchReplayer->frames());
+        touch["framesPerSecond"] = m_touchReplayer->frames() / seconds;
+        touch["stalledFrames"] = double(m_touchReplayer->stalledFrames());
+        touch["dispatch"] = stats.value(QLatin1String("dispatch"));
+        touch["motionEvents"] = stats.value(QLatin1String("input")).toObject().value(QLatin1String("motionEvents"));
+        touch["motionEventsDelivered"] = stats.value(QLatin1String("input")).toObject()
+                .value(QLatin1String("motionEventsDelivered"));
+        result["touch"] = touch;
+    }
+
+    if (m_config.scenario == BenchmarkConfig::ControlScenario) {
+        const double jsonRate = m_controlPhases.value(QLatin1String("json")).toObject()
+                .value(QLatin1String("messagesPerSecond")).toDouble();
+        const double binaryRate = m_controlPhases.value(QLatin1String("binary")).toObject()
+                .value(QLatin1String("messagesPerSecond")).toDouble();
+
+        QJsonObject control = m_controlPhases;
+        control["batchSize"] = controlBatchSize;
+        control["binarySpeedup"] = jsonRate > 0 ? binaryRate / jsonRate : 0.0;
+        control["errors"] = stats.value(QLatin1String("socket")).toObject().value(QLatin1String("errors"));
+        result["control"] = control;
+    }
+
+    return result;
+}
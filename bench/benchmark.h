@@ -0,0 +1,131 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QObject>
+#include <QProcess>
+#include <QLocalSocket>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QVector>
+#include <QTimer>
+#include "syntheticwindow.h"
+#include "controlclient.h"
+
+class SurfaceChurner;
+class TouchReplayer;
+
+struct BenchmarkConfig
+{
+    enum Scenario {
+        // Only the windows, redrawing
+        FramesScenario,
+        // Short-lived surfaces created and destroyed back to back, next
+        // to the windows
+        SurfacesScenario,
+        // Control socket clients sending commands as fast as they can,
+        // while the windows redraw, first in JSON and then in the binary
+        // encoding
+        ControlScenario,
+        // Multi-finger gestures replayed through an evdev FIFO, across
+        // the windows
+        TouchScenario,
+        // Single-finger taps at random places, hit-testing windows made
+        // of many tiles
+        HitTestScenario,
+        ScenarioCount
+    };
+
+    // Names used on the command line, indexed by Scenario
+    static const char *const scenarioNames[ScenarioCount];
+
+    Scenario scenario;
+    QString compositor;
+    // Qt platform plugin the compositor runs on
+    QString platform;
+    bool softwareGl;
+
+    int windows;
+    // Cycled through for the windows
+    QVector<QSize> sizes;
+    int commitRate;
+    WindowConfig::Damage damage;
+    int subsurfaceDepth;
+    // Tile subsurfaces in each window
+    int tiles;
+    // Milliseconds between replacing the oldest window, 0 for never
+    int churnInterval;
+    // Control socket clients in the control scenario
+    int connections;
+    // Fingers of each gesture in the touch scenario
+    int fingers;
+
+    // Seconds
+    int warmup;
+    int duration;
+};
+
+// Starts a private compositor instance, connects the synthetic windows
+// to it and, once the warmup is over, measures for the configured
+// duration. The results are written to stdout as JSON.
+class Benchmark : public QObject
+{
+    Q_OBJECT
+public:
+    explicit Benchmark(const BenchmarkConfig &config, QObject *parent = nullptr);
+    ~Benchmark();
+
+    void start();
+
+signals:
+    void finished(int exitCode);
+
+private:
+    void connectWindows();
+    SyntheticWindow *createWindow();
+    void startMeasuring();
+    void churn();
+    void startControlClients(ControlClient::Encoding encoding);
+    void switchControlEncoding();
+    void finishControlPhase();
+    void finish();
+    void fail(const QString &error);
+    void stopCompositor();
+
+    bool queryStats(bool reset, QJsonObject *stats);
+    QJsonObject report(const QJsonObject &stats) const;
+
+    BenchmarkConfig m_config;
+    QByteArray m_socketName;
+    QString m_controlPath;
+    QProcess m_process;
+    QLocalSocket m_control;
+
+    QVector<SyntheticWindow *> m_windows;
+    SurfaceChurner *m_churner;
+    TouchReplayer *m_touchReplayer;
+    QVector<ControlClient *> m_controlClients;
+    ControlClient::Encoding m_controlEncoding;
+    QElapsedTimer m_controlElapsed;
+    // Results of each encoding, keyed by its name
+    QJsonObject m_controlPhases;
+    int m_windowsCreated;
+    // Windows created before the measurement started
+    int m_windowsCreatedBefore;
+    int m_connectAttempts;
+    bool m_done;
+    QTimer m_connectTimer;
+    QTimer m_churnTimer;
+    QElapsedTimer m_elapsed;
+
+    // Compositor counters when the measurement started
+    double m_viewsAllocatedBefore;
+    double m_viewsReusedBefore;
+
+    // Counters of windows that were churned away during the measurement
+    quint64 m_retiredCommits;
+    quint64 m_retiredSkippedCommits;
+    quint64 m_retiredFrames;
+    QVector<qint64> m_retiredLatencies;
+};
+
+#endif // BENCHMARK_H
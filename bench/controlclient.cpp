@@ -0,0 +1,100 @@
+#include "controlclient.h"
+#include "controlprotocol.h"
+
+#include <QDebug>
+#include <cstring>
+
+const char *const ControlClient::encodingNames[ControlClient::EncodingCount] = {
+    "json", "binary"
+};
+
+static void appendBinary(QByteArray *data, ControlCommand::Type type, qint32 value)
+{
+    ControlMessage message;
+    memset(&message, 0, sizeof(message));
+    message.type = type;
+    message.value = value;
+    data->append(reinterpret_cast<const char *>(&message), int(sizeof(message)));
+}
+
+ControlClient::ControlClient(Encoding encoding, int batchSize, QObject *parent)
+    : QObject(parent)
+    , m_encoding(encoding)
+    , m_batchSize(batchSize)
+    , m_socket(this)
+    , m_messages(0)
+{
+    // Resuming while not suspended is a no-op, as the power manager does
+    // it all the time
+    for (int i = 0; i < m_batchSize; i++) {
+        if (m_encoding == BinaryEncoding)
+            appendBinary(&m_batch, ControlCommand::SetSuspended, 0);
+        else
+            m_batch.append("{\"suspended\":false}").append('\0');
+    }
+
+    if (m_encoding == BinaryEncoding)
+        appendBinary(&m_batch, ControlCommand::QueryStats, 0);
+    else
+        m_batch.append("{\"query\":\"stats\"}").append('\0');
+
+    connect(&m_socket, &QLocalSocket::readyRead, this, &ControlClient::readReplies);
+    connect(&m_socket, &QLocalSocket::disconnected, this, &ControlClient::failed);
+}
+
+// Going away is not a failure
+ControlClient::~ControlClient()
+{
+    m_socket.disconnect(this);
+}
+
+bool ControlClient::connectTo(const QString &path)
+{
+    m_socket.connectToServer(path);
+    if (!m_socket.waitForConnected(5000))
+        return false;
+
+    if (m_encoding == BinaryEncoding)
+        m_socket.write(&ControlProtocol::BinaryMagic, 1);
+    return true;
+}
+
+void ControlClient::start()
+{
+    sendBatch();
+}
+
+void ControlClient::sendBatch()
+{
+    m_batchTimer.start();
+    m_socket.write(m_batch);
+}
+
+// Only the stats query is answered, anything else is an error
+void ControlClient::readReplies()
+{
+    const QByteArray data = m_socket.readAll();
+
+    int start = 0;
+    for (;;) {
+        const int end = data.indexOf('\0', start);
+        if (end < 0)
+            break;
+
+        m_reply.append(data.constData() + start, end - start);
+        if (m_reply.startsWith("{\"error\"")) {
+            qWarning().noquote() << "Control socket error:" << m_reply;
+            m_socket.disconnectFromServer();
+            return;
+        }
+        m_reply.clear();
+
+        m_batchTimes.append(m_batchTimer.nsecsElapsed());
+        m_messages += quint64(m_batchSize) + 1;
+        sendBatch();
+
+        start = end + 1;
+    }
+
+    m_reply.append(data.constData() + start, data.size() - start);
+}
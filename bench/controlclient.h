@@ -0,0 +1,59 @@
+#ifndef CONTROLCLIENT_H
+#define CONTROLCLIENT_H
+
+#include <QObject>
+#include <QLocalSocket>
+#include <QElapsedTimer>
+#include <QVector>
+
+// A synthetic control socket client, like the sensor daemons that send
+// commands at high rates. It sends batches of commands that change
+// nothing, each followed by a stats query whose reply tells that the
+// compositor has handled the whole batch, and then sends the next one.
+class ControlClient : public QObject
+{
+    Q_OBJECT
+public:
+    enum Encoding {
+        JsonEncoding,
+        BinaryEncoding,
+        EncodingCount
+    };
+
+    // Names used in the report, indexed by Encoding
+    static const char *const encodingNames[EncodingCount];
+
+    // batchSize is the number of commands sent before each stats query
+    ControlClient(Encoding encoding, int batchSize, QObject *parent = nullptr);
+    ~ControlClient();
+
+    // Returns false if the compositor is not there
+    bool connectTo(const QString &path);
+    void start();
+
+    // Messages the compositor has handled, stats queries included
+    quint64 messages() const { return m_messages; }
+    // Time from sending each batch to its reply, in ns
+    const QVector<qint64> &batchTimes() const { return m_batchTimes; }
+
+signals:
+    void failed();
+
+private:
+    void sendBatch();
+    void readReplies();
+
+    const Encoding m_encoding;
+    const int m_batchSize;
+    QLocalSocket m_socket;
+    // The same bytes go out for every batch
+    QByteArray m_batch;
+    // Part of a reply that came in so far
+    QByteArray m_reply;
+
+    QElapsedTimer m_batchTimer;
+    quint64 m_messages;
+    QVector<qint64> m_batchTimes;
+};
+
+#endif // CONTROLCLIENT_H
@@ -0,0 +1,146 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+
+#include "benchmark.h"
+
+static bool parseSizes(const QString &value, QVector<QSize> *sizes)
+{
+    const QStringList list = value.split(QLatin1Char(','), QString::SkipEmptyParts);
+    for (const QString &item : list) {
+        const QStringList parts = item.split(QLatin1Char('x'));
+        bool okWidth = false, okHeight = false;
+        const QSize size = parts.count() == 2
+                ? QSize(parts.at(0).toInt(&okWidth), parts.at(1).toInt(&okHeight))
+                : QSize();
+        if (!okWidth || !okHeight || size.isEmpty())
+            return false;
+        sizes->append(size);
+    }
+
+    return !sizes->isEmpty();
+}
+
+static bool parseScenario(const QString &value, BenchmarkConfig::Scenario *scenario)
+{
+    for (int i = 0; i < BenchmarkConfig::ScenarioCount; i++) {
+        if (value == QLatin1String(BenchmarkConfig::scenarioNames[i])) {
+            *scenario = BenchmarkConfig::Scenario(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool parseDamage(const QString &value, WindowConfig::Damage *damage)
+{
+    for (int i = 0; i < WindowConfig::DamageCount; i++) {
+        if (value == QLatin1String(WindowConfig::damageNames[i])) {
+            *damage = WindowConfig::Damage(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Runs nubbock headless against synthetic wl_shm clients"));
+    parser.addHelpOption();
+
+    const QCommandLineOption scenarioOption(QStringLiteral("scenario"),
+            QStringLiteral("What to measure: frames, surfaces, control, touch or hittest."), QStringLiteral("name"),
+            QStringLiteral("frames"));
+    const QCommandLineOption compositorOption(QStringLiteral("compositor"),
+            QStringLiteral("Compositor binary to run."), QStringLiteral("path"),
+            QCoreApplication::applicationDirPath() + QStringLiteral("/../nubbock"));
+    const QCommandLineOption platformOption(QStringLiteral("platform"),
+            QStringLiteral("Qt platform plugin for the compositor, it has to provide EGL."), QStringLiteral("name"),
+            QStringLiteral("xcb"));
+    const QCommandLineOption hardwareGlOption(QStringLiteral("hardware-gl"),
+            QStringLiteral("Use the GPU instead of Mesa's software rasterizer."));
+    const QCommandLineOption windowsOption(QStringLiteral("windows"),
+            QStringLiteral("Number of windows, each one a client of its own."), QStringLiteral("count"),
+            QStringLiteral("4"));
+    const QCommandLineOption sizesOption(QStringLiteral("sizes"),
+            QStringLiteral("Comma-separated window sizes, cycled through."), QStringLiteral("WxH,..."),
+            QStringLiteral("400x300"));
+    const QCommandLineOption rateOption(QStringLiteral("rate"),
+            QStringLiteral("Commits per second and window, 0 to commit on every frame callback."),
+            QStringLiteral("hz"), QStringLiteral("0"));
+    const QCommandLineOption damageOption(QStringLiteral("damage"),
+            QStringLiteral("Damage pattern: full, rect, scroll or none."), QStringLiteral("pattern"),
+            QStringLiteral("full"));
+    const QCommandLineOption depthOption(QStringLiteral("subsurfaces"),
+            QStringLiteral("Depth of the chain of subsurfaces in each window."), QStringLiteral("depth"),
+            QStringLiteral("0"));
+    const QCommandLineOption tilesOption(QStringLiteral("tiles"),
+            QStringLiteral("Subsurfaces laid out in a grid over each window."), QStringLiteral("count"),
+            QStringLiteral("0"));
+    const QCommandLineOption churnOption(QStringLiteral("churn"),
+            QStringLiteral("Replace the oldest window every so many milliseconds, 0 for never."),
+            QStringLiteral("ms"), QStringLiteral("0"));
+    const QCommandLineOption connectionsOption(QStringLiteral("connections"),
+            QStringLiteral("Control socket clients in the control scenario."), QStringLiteral("count"),
+            QStringLiteral("3"));
+    const QCommandLineOption fingersOption(QStringLiteral("fingers"),
+            QStringLiteral("Fingers of each gesture in the touch scenario."), QStringLiteral("count"),
+            QStringLiteral("3"));
+    const QCommandLineOption warmupOption(QStringLiteral("warmup"),
+            QStringLiteral("Seconds to run before measuring."), QStringLiteral("seconds"),
+            QStringLiteral("2"));
+    const QCommandLineOption durationOption(QStringLiteral("duration"),
+            QStringLiteral("Seconds to measure."), QStringLiteral("seconds"), QStringLiteral("10"));
+
+    parser.addOptions({ scenarioOption, compositorOption, platformOption, hardwareGlOption, windowsOption, sizesOption,
+                        rateOption, damageOption, depthOption, tilesOption, churnOption, connectionsOption,
+                        fingersOption, warmupOption, durationOption });
+    parser.process(app);
+
+    BenchmarkConfig config;
+    config.compositor = parser.value(compositorOption);
+    config.platform = parser.value(platformOption);
+    config.softwareGl = !parser.isSet(hardwareGlOption);
+    config.windows = parser.value(windowsOption).toInt();
+    config.commitRate = parser.value(rateOption).toInt();
+    config.subsurfaceDepth = parser.value(depthOption).toInt();
+    config.tiles = parser.value(tilesOption).toInt();
+    config.churnInterval = parser.value(churnOption).toInt();
+    config.connections = parser.value(connectionsOption).toInt();
+    config.fingers = parser.value(fingersOption).toInt();
+    config.warmup = parser.value(warmupOption).toInt();
+    config.duration = parser.value(durationOption).toInt();
+
+    if (!parseScenario(parser.value(scenarioOption), &config.scenario)) {
+        qWarning() << "Unknown scenario:" << parser.value(scenarioOption);
+        return 1;
+    }
+
+    if (!parseSizes(parser.value(sizesOption), &config.sizes)) {
+        qWarning() << "Invalid window sizes:" << parser.value(sizesOption);
+        return 1;
+    }
+
+    if (!parseDamage(parser.value(damageOption), &config.damage)) {
+        qWarning() << "Unknown damage pattern:" << parser.value(damageOption);
+        return 1;
+    }
+
+    if (config.windows < 1 || config.duration < 1 || config.commitRate < 0
+            || config.subsurfaceDepth < 0 || config.tiles < 0 || config.churnInterval < 0 || config.connections < 1
+            || config.fingers < 1 || config.fingers > 10 || config.warmup < 0) {
+        qWarning() << "Invalid benchmark parameters";
+        return 1;
+    }
+
+    Benchmark benchmark(config);
+    QObject::connect(&benchmark, &Benchmark::finished, &app, &QCoreApplication::exit, Qt::QueuedConnection);
+    benchmark.start();
+
+    return app.exec();
+}
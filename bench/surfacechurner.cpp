@@ -0,0 +1,217 @@
+#include "surfacechurner.h"
+
+#include <QSocketNotifier>
+#include <QVarLengthArray>
+#include <QDebug>
+
+#include <wayland-client.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <cstring>
+
+// Side of the square buffer every churned surface shows
+static const int surfaceSize = 32;
+
+static qint64 now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+SurfaceChurner::SurfaceChurner(int subsurfaceDepth, QObject *parent)
+    : QObject(parent)
+    , m_subsurfaceDepth(subsurfaceDepth)
+    , m_display(nullptr)
+    , m_registry(nullptr)
+    , m_compositor(nullptr)
+    , m_shm(nullptr)
+    , m_shell(nullptr)
+    , m_subcompositor(nullptr)
+    , m_buffer(nullptr)
+    , m_sync(nullptr)
+    , m_notifier(nullptr)
+    , m_cycleStart(0)
+    , m_cycles(0)
+{
+}
+
+SurfaceChurner::~SurfaceChurner()
+{
+    delete m_notifier;
+
+    if (m_sync)
+        wl_callback_destroy(m_sync);
+    if (m_buffer)
+        wl_buffer_destroy(m_buffer);
+    if (m_subcompositor)
+        wl_subcompositor_destroy(m_subcompositor);
+    if (m_shell)
+        wl_shell_destroy(m_shell);
+    if (m_shm)
+        wl_shm_destroy(m_shm);
+    if (m_compositor)
+        wl_compositor_destroy(m_compositor);
+    if (m_registry)
+        wl_registry_destroy(m_registry);
+    if (m_display)
+        wl_display_disconnect(m_display);
+}
+
+bool SurfaceChurner::connectTo(const QByteArray &socketName)
+{
+    static const wl_registry_listener registryListener = {
+        registryGlobal,
+        registryGlobalRemove
+    };
+
+    m_display = wl_display_connect(socketName.constData());
+    if (!m_display)
+        return false;
+
+    m_registry = wl_display_get_registry(m_display);
+    wl_registry_add_listener(m_registry, &registryListener, this);
+    wl_display_roundtrip(m_display);
+
+    if (!m_compositor || !m_shm || !m_shell || (m_subsurfaceDepth > 0 && !m_subcompositor)) {
+        qWarning() << "Compositor lacks wl_compositor, wl_shm, wl_shell or wl_subcompositor";
+        return false;
+    }
+
+    if (!createBuffer())
+        return false;
+
+    m_notifier = new QSocketNotifier(wl_display_get_fd(m_display), QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &SurfaceChurner::dispatch);
+    return true;
+}
+
+bool SurfaceChurner::createBuffer()
+{
+    const int stride = surfaceSize * 4;
+    const size_t size = size_t(stride) * surfaceSize;
+
+    QByteArray path = qgetenv("XDG_RUNTIME_DIR") + "/nubbock-bench-XXXXXX";
+    const int fd = mkostemp(path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        qWarning() << "Failed to create shm file:" << strerror(errno);
+        return false;
+    }
+    unlink(path.constData());
+
+    if (ftruncate(fd, off_t(size)) < 0) {
+        qWarning() << "Failed to size shm file:" << strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    // Zero-filled by ftruncate, which is opaque black in XRGB8888
+    wl_shm_pool *pool = wl_shm_create_pool(m_shm, fd, int32_t(size));
+    close(fd);
+    m_buffer = wl_shm_pool_create_buffer(pool, 0, surfaceSize, surfaceSize, stride, WL_SHM_FORMAT_XRGB8888);
+    wl_shm_pool_destroy(pool);
+    return true;
+}
+
+void SurfaceChurner::start()
+{
+    cycle();
+}
+
+void SurfaceChurner::resetCounters()
+{
+    m_cycles = 0;
+    m_cycleTimes.clear();
+}
+
+// The whole life of a surface goes out in one batch, followed by the
+// sync that tells when the compositor is through with it. Subsurfaces
+// are synchronized, so they show up with the toplevel's commit.
+void SurfaceChurner::cycle()
+{
+    static const wl_callback_listener syncListener = {
+        syncDone
+    };
+
+    m_cycleStart = now();
+
+    QVarLengthArray<wl_surface *, 8> surfaces;
+    QVarLengthArray<wl_subsurface *, 8> subsurfaces;
+    surfaces.append(wl_compositor_create_surface(m_compositor));
+    wl_shell_surface *shellSurface = wl_shell_get_shell_surface(m_shell, surfaces.first());
+    wl_shell_surface_set_toplevel(shellSurface);
+
+    for (int i = 0; i < m_subsurfaceDepth; i++) {
+        wl_surface *surface = wl_compositor_create_surface(m_compositor);
+        wl_subsurface *subsurface = wl_subcompositor_get_subsurface(m_subcompositor, surface, surfaces.last());
+        wl_subsurface_set_position(subsurface, 4, 4);
+        surfaces.append(surface);
+        subsurfaces.append(subsurface);
+    }
+
+    for (int i = surfaces.count() - 1; i >= 0; i--) {
+        wl_surface_attach(surfaces.at(i), m_buffer, 0, 0);
+        wl_surface_damage(surfaces.at(i), 0, 0, surfaceSize, surfaceSize);
+        wl_surface_commit(surfaces.at(i));
+    }
+
+    for (int i = subsurfaces.count() - 1; i >= 0; i--) {
+        wl_subsurface_destroy(subsurfaces.at(i));
+        wl_surface_destroy(surfaces.at(i + 1));
+    }
+    wl_shell_surface_destroy(shellSurface);
+    wl_surface_destroy(surfaces.first());
+
+    m_sync = wl_display_sync(m_display);
+    wl_callback_add_listener(m_sync, &syncListener, this);
+    wl_display_flush(m_display);
+}
+
+void SurfaceChurner::dispatch()
+{
+    if (wl_display_dispatch(m_display) < 0) {
+        qWarning() << "Lost connection to the compositor:" << strerror(errno);
+        m_notifier->setEnabled(false);
+        emit failed();
+        return;
+    }
+
+    wl_display_flush(m_display);
+}
+
+void SurfaceChurner::registryGlobal(void *data, wl_registry *registry, uint32_t name,
+                                    const char *interface, uint32_t version)
+{
+    SurfaceChurner *churner = static_cast<SurfaceChurner *>(data);
+
+    if (!strcmp(interface, wl_compositor_interface.name)) {
+        churner->m_compositor = static_cast<wl_compositor *>(
+                    wl_registry_bind(registry, name, &wl_compositor_interface, qMin(version, 3u)));
+    } else if (!strcmp(interface, wl_shm_interface.name)) {
+        churner->m_shm = static_cast<wl_shm *>(wl_registry_bind(registry, name, &wl_shm_interface, 1));
+    } else if (!strcmp(interface, wl_shell_interface.name)) {
+        churner->m_shell = static_cast<wl_shell *>(wl_registry_bind(registry, name, &wl_shell_interface, 1));
+    } else if (!strcmp(interface, wl_subcompositor_interface.name)) {
+        churner->m_subcompositor = static_cast<wl_subcompositor *>(
+                    wl_registry_bind(registry, name, &wl_subcompositor_interface, 1));
+    }
+}
+
+void SurfaceChurner::registryGlobalRemove(void *, wl_registry *, uint32_t)
+{
+}
+
+void SurfaceChurner::syncDone(void *data, wl_callback *callback, uint32_t)
+{
+    SurfaceChurner *churner = static_cast<SurfaceChurner *>(data);
+
+    churner->m_cycleTimes.append(now() - churner->m_cycleStart);
+    churner->m_cycles++;
+    wl_callback_destroy(callback);
+    churner->m_sync = nullptr;
+
+    churner->cycle();
+}
@@ -0,0 +1,75 @@
+#ifndef SURFACECHURNER_H
+#define SURFACECHURNER_H
+
+#include <QObject>
+#include <QVector>
+#include <QByteArray>
+
+struct wl_display;
+struct wl_registry;
+struct wl_compositor;
+struct wl_shm;
+struct wl_shell;
+struct wl_subcompositor;
+struct wl_buffer;
+struct wl_callback;
+class QSocketNotifier;
+
+// A synthetic client that creates and destroys short-lived surfaces as
+// fast as the compositor keeps up, like tooltips and popups do. Each
+// cycle maps a wl_shell toplevel with a small buffer, optionally with a
+// chain of subsurfaces, and destroys it again. A cycle is complete once
+// the compositor answered a sync request sent right after.
+class SurfaceChurner : public QObject
+{
+    Q_OBJECT
+public:
+    // subsurfaceDepth is the number of subsurfaces nested below each
+    // toplevel
+    explicit SurfaceChurner(int subsurfaceDepth, QObject *parent = nullptr);
+    ~SurfaceChurner();
+
+    // Returns false if the compositor is not there
+    bool connectTo(const QByteArray &socketName);
+    void start();
+
+    // Surfaces created and destroyed by each cycle
+    int surfacesPerCycle() const { return m_subsurfaceDepth + 1; }
+    quint64 cycles() const { return m_cycles; }
+    // Time from creating each surface to the compositor having handled its
+    // destruction, in ns
+    const QVector<qint64> &cycleTimes() const { return m_cycleTimes; }
+    void resetCounters();
+
+signals:
+    void failed();
+
+private:
+    static void registryGlobal(void *data, wl_registry *registry, uint32_t name,
+                               const char *interface, uint32_t version);
+    static void registryGlobalRemove(void *data, wl_registry *registry, uint32_t name);
+    static void syncDone(void *data, wl_callback *callback, uint32_t serial);
+
+    bool createBuffer();
+    void cycle();
+    void dispatch();
+
+    const int m_subsurfaceDepth;
+
+    wl_display *m_display;
+    wl_registry *m_registry;
+    wl_compositor *m_compositor;
+    wl_shm *m_shm;
+    wl_shell *m_shell;
+    wl_subcompositor *m_subcompositor;
+    // Attached to every surface, the content doesn't matter
+    wl_buffer *m_buffer;
+    wl_callback *m_sync;
+
+    QSocketNotifier *m_notifier;
+    qint64 m_cycleStart;
+    quint64 m_cycles;
+    QVector<qint64> m_cycleTimes;
+};
+
+#endif // SURFACECHURNER_H
@@ -0,0 +1,411 @@
+#include "syntheticwindow.h"
+
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QDebug>
+#include <QtMath>
+
+#include <wayland-client.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+
+// Same clock as the compositor's frame clock
+static qint64 now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Windows all map at the same place with the same size. Translucent
+// content keeps the compositor from culling all but the topmost.
+static const quint32 windowAlpha = 0xc0;
+
+// Premultiplied ARGB of rgb at windowAlpha
+static quint32 translucent(quint32 rgb)
+{
+    const quint32 r = ((rgb >> 16) & 0xff) * windowAlpha / 0xff;
+    const quint32 g = ((rgb >> 8) & 0xff) * windowAlpha / 0xff;
+    const quint32 b = (rgb & 0xff) * windowAlpha / 0xff;
+    return (windowAlpha << 24) | (r << 16) | (g << 8) | b;
+}
+
+const char *const WindowConfig::damageNames[WindowConfig::DamageCount] = {
+    "full", "rect", "scroll", "none"
+};
+
+SyntheticWindow::SyntheticWindow(const WindowConfig &config, QObject *parent)
+    : QObject(parent)
+    , m_config(config)
+    , m_display(nullptr)
+    , m_registry(nullptr)
+    , m_compositor(nullptr)
+    , m_subcompositor(nullptr)
+    , m_shm(nullptr)
+    , m_shell(nullptr)
+    , m_shellSurface(nullptr)
+    , m_frameCallback(nullptr)
+    , m_pool(nullptr)
+    , m_poolSize(0)
+    , m_notifier(nullptr)
+    , m_commitTimer(nullptr)
+    , m_step(0)
+    , m_commitTime(0)
+    , m_commits(0)
+    , m_skippedCommits(0)
+    , m_frames(0)
+{
+}
+
+SyntheticWindow::~SyntheticWindow()
+{
+    delete m_notifier;
+
+    if (m_frameCallback)
+        wl_callback_destroy(m_frameCallback);
+    if (m_shellSurface)
+        wl_shell_surface_destroy(m_shellSurface);
+
+    // Children first
+    for (int i = m_surfaces.count() - 1; i >= 0; i--) {
+        Surface &surface = m_surfaces[i];
+        for (Buffer &buffer : surface.buffers) {
+            if (buffer.buffer)
+                wl_buffer_destroy(buffer.buffer);
+        }
+        if (surface.subsurface)
+            wl_subsurface_destroy(surface.subsurface);
+        wl_surface_destroy(surface.surface);
+    }
+
+    if (m_shell)
+        wl_shell_destroy(m_shell);
+    if (m_shm)
+        wl_shm_destroy(m_shm);
+    if (m_subcompositor)
+        wl_subcompositor_destroy(m_subcompositor);
+    if (m_compositor)
+        wl_compositor_destroy(m_compositor);
+    if (m_registry)
+        wl_registry_destroy(m_registry);
+    if (m_display)
+        wl_display_disconnect(m_display);
+
+    if (m_pool)
+        munmap(m_pool, m_poolSize);
+}
+
+bool SyntheticWindow::connectTo(const QByteArray &socketName)
+{
+    static const wl_registry_listener registryListener = {
+        registryGlobal,
+        registryGlobalRemove
+    };
+    static const wl_shell_surface_listener shellSurfaceListener = {
+        shellSurfacePing,
+        shellSurfaceConfigure,
+        shellSurfacePopupDone
+    };
+
+    m_display = wl_display_connect(socketName.constData());
+    if (!m_display)
+        return false;
+
+    m_registry = wl_display_get_registry(m_display);
+    wl_registry_add_listener(m_registry, &registryListener, this);
+    wl_display_roundtrip(m_display);
+
+    if (!m_compositor || !m_shm || !m_shell
+            || ((m_config.subsurfaceDepth > 0 || m_config.tiles > 0) && !m_subcompositor)) {
+        qWarning() << "Compositor lacks wl_compositor, wl_shm, wl_shell or wl_subcompositor";
+        return false;
+    }
+
+    m_surfaces.resize(m_config.subsurfaceDepth + 1);
+    for (int i = 0; i < m_surfaces.count(); i++) {
+        Surface &surface = m_surfaces[i];
+        surface.surface = wl_compositor_create_surface(m_compositor);
+        surface.subsurface = nullptr;
+        memset(surface.buffers, 0, sizeof(surface.buffers));
+
+        if (i == 0) {
+            surface.size = m_config.size;
+        } else {
+            const QSize parentSize = m_surfaces.at(i - 1).size;
+            surface.size = QSize(qMax(16, parentSize.width() - 32), qMax(16, parentSize.height() - 32));
+            surface.subsurface = wl_subcompositor_get_subsurface(m_subcompositor, surface.surface,
+                                                                 m_surfaces.at(i - 1).surface);
+            wl_subsurface_set_position(surface.subsurface, 16, 16);
+            wl_subsurface_set_desync(surface.subsurface);
+        }
+    }
+
+    // Tiles are stacked above the chain
+    if (m_config.tiles > 0) {
+        const int columns = qCeil(qSqrt(qreal(m_config.tiles)));
+        const int rows = (m_config.tiles + columns - 1) / columns;
+        const QSize tileSize(qMax(1, m_config.size.width() / columns), qMax(1, m_config.size.height() / rows));
+
+        for (int i = 0; i < m_config.tiles; i++) {
+            Surface surface;
+            surface.surface = wl_compositor_create_surface(m_compositor);
+            surface.size = tileSize;
+            memset(surface.buffers, 0, sizeof(surface.buffers));
+            surface.subsurface = wl_subcompositor_get_subsurface(m_subcompositor, surface.surface,
+                                                                 m_surfaces.first().surface);
+            wl_subsurface_set_position(surface.subsurface, i % columns * tileSize.width(),
+                                       i / columns * tileSize.height());
+            wl_subsurface_set_desync(surface.subsurface);
+            m_surfaces.append(surface);
+        }
+    }
+
+    m_shellSurface = wl_shell_get_shell_surface(m_shell, m_surfaces.first().surface);
+    wl_shell_surface_add_listener(m_shellSurface, &shellSurfaceListener, this);
+    wl_shell_surface_set_toplevel(m_shellSurface);
+
+    if (!createBuffers())
+        return false;
+
+    m_notifier = new QSocketNotifier(wl_display_get_fd(m_display), QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &SyntheticWindow::dispatch);
+    return true;
+}
+
+// All buffers of the window share one pool, two per surface
+bool SyntheticWindow::createBuffers()
+{
+    static const wl_buffer_listener bufferListener = {
+        bufferRelease
+    };
+
+    m_poolSize = 0;
+    for (const Surface &surface : qAsConst(m_surfaces))
+        m_poolSize += 2 * size_t(surface.size.width()) * surface.size.height() * 4;
+
+    QByteArray path = qgetenv("XDG_RUNTIME_DIR") + "/nubbock-bench-XXXXXX";
+    const int fd = mkostemp(path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        qWarning() << "Failed to create shm file:" << strerror(errno);
+        return false;
+    }
+    unlink(path.constData());
+
+    if (ftruncate(fd, off_t(m_poolSize)) < 0) {
+        qWarning() << "Failed to size shm file:" << strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, m_poolSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        qWarning() << "Failed to map shm file:" << strerror(errno);
+        close(fd);
+        return false;
+    }
+    m_pool = static_cast<uchar *>(data);
+
+    // The fd is duplicated when the request is sent
+    wl_shm_pool *pool = wl_shm_create_pool(m_shm, fd, int32_t(m_poolSize));
+    close(fd);
+
+    size_t offset = 0;
+    for (Surface &surface : m_surfaces) {
+        const int stride = surface.size.width() * 4;
+        for (Buffer &buffer : surface.buffers) {
+            buffer.buffer = wl_shm_pool_create_buffer(pool, int32_t(offset), surface.size.width(),
+                                                      surface.size.height(), stride, WL_SHM_FORMAT_ARGB8888);
+            buffer.data = m_pool + offset;
+            buffer.busy = false;
+            wl_buffer_add_listener(buffer.buffer, &bufferListener, &buffer);
+            offset += size_t(stride) * surface.size.height();
+        }
+    }
+
+    wl_shm_pool_destroy(pool);
+    return true;
+}
+
+void SyntheticWindow::start()
+{
+    // Subsurfaces get their content once, and show up with the first
+    // commit of the toplevel surface
+    for (int i = m_surfaces.count() - 1; i > 0; i--) {
+        Surface &surface = m_surfaces[i];
+        Buffer &buffer = surface.buffers[0];
+        fill(buffer, surface.size, QRect(QPoint(), surface.size), translucent(0x204080 + quint32(i) * 0x101010));
+        wl_surface_attach(surface.surface, buffer.buffer, 0, 0);
+        wl_surface_damage(surface.surface, 0, 0, surface.size.width(), surface.size.height());
+        wl_surface_commit(surface.surface);
+        buffer.busy = true;
+    }
+
+    if (m_config.commitRate > 0) {
+        m_commitTimer = new QTimer(this);
+        m_commitTimer->setTimerType(Qt::PreciseTimer);
+        m_commitTimer->setInterval(qMax(1, 1000 / m_config.commitRate));
+        connect(m_commitTimer, &QTimer::timeout, this, &SyntheticWindow::redraw);
+        m_commitTimer->start();
+    }
+
+    redraw();
+}
+
+void SyntheticWindow::resetCounters()
+{
+    m_commits = 0;
+    m_skippedCommits = 0;
+    m_frames = 0;
+    m_latencies.clear();
+}
+
+void SyntheticWindow::fill(const Buffer &buffer, const QSize &size, const QRect &rect, quint32 color)
+{
+    const QRect clipped = rect & QRect(QPoint(), size);
+    for (int y = clipped.top(); y <= clipped.bottom(); y++) {
+        quint32 *row = reinterpret_cast<quint32 *>(buffer.data + y * size.width() * 4) + clipped.left();
+        std::fill_n(row, clipped.width(), color);
+    }
+}
+
+// A commit is skipped when the previous frame was not shown yet, or both
+// buffers are still held by the compositor.
+void SyntheticWindow::redraw()
+{
+    static const wl_callback_listener frameListener = {
+        frameDone
+    };
+
+    Surface &surface = m_surfaces.first();
+    Buffer *buffer = nullptr;
+    for (Buffer &candidate : surface.buffers) {
+        if (!candidate.busy) {
+            buffer = &candidate;
+            break;
+        }
+    }
+
+    if (m_frameCallback || !buffer) {
+        m_skippedCommits++;
+        return;
+    }
+
+    const int width = surface.size.width();
+    const int height = surface.size.height();
+    QRect rect;
+    switch (m_config.damage) {
+    case WindowConfig::FullDamage:
+        rect = QRect(0, 0, width, height);
+        break;
+    case WindowConfig::RectDamage: {
+        const int side = qMin(64, qMin(width, height));
+        rect = QRect(int(m_step * 8 % quint32(qMax(1, width - side))),
+                     int(m_step * 4 % quint32(qMax(1, height - side))), side, side);
+        break;
+    }
+    case WindowConfig::ScrollDamage: {
+        const int strip = qMin(32, height);
+        rect = QRect(0, int(m_step * 4 % quint32(qMax(1, height - strip))), width, strip);
+        break;
+    }
+    case WindowConfig::NoDamage:
+    case WindowConfig::DamageCount:
+        break;
+    }
+
+    m_step++;
+    if (!rect.isEmpty())
+        fill(*buffer, surface.size, rect, translucent(m_step * 0x030507));
+
+    wl_surface_attach(surface.surface, buffer->buffer, 0, 0);
+    buffer->busy = true;
+
+    // What moved away from its last position needs repainting as well
+    if (!rect.isEmpty()) {
+        wl_surface_damage(surface.surface, rect.x(), rect.y(), rect.width(), rect.height());
+        if (!m_lastDamage.isEmpty() && m_lastDamage != rect)
+            wl_surface_damage(surface.surface, m_lastDamage.x(), m_lastDamage.y(),
+                              m_lastDamage.width(), m_lastDamage.height());
+    }
+    m_lastDamage = rect;
+
+    m_frameCallback = wl_surface_frame(surface.surface);
+    wl_callback_add_listener(m_frameCallback, &frameListener, this);
+
+    m_commitTime = now();
+    wl_surface_commit(surface.surface);
+    m_commits++;
+    wl_display_flush(m_display);
+}
+
+void SyntheticWindow::dispatch()
+{
+    if (wl_display_dispatch(m_display) < 0) {
+        qWarning() << "Lost connection to the compositor:" << strerror(errno);
+        m_notifier->setEnabled(false);
+        if (m_commitTimer)
+            m_commitTimer->stop();
+        emit failed();
+        return;
+    }
+
+    wl_display_flush(m_display);
+}
+
+void SyntheticWindow::registryGlobal(void *data, wl_registry *registry, uint32_t name,
+                                     const char *interface, uint32_t version)
+{
+    SyntheticWindow *window = static_cast<SyntheticWindow *>(data);
+
+    if (!strcmp(interface, wl_compositor_interface.name)) {
+        window->m_compositor = static_cast<wl_compositor *>(
+                    wl_registry_bind(registry, name, &wl_compositor_interface, qMin(version, 3u)));
+    } else if (!strcmp(interface, wl_subcompositor_interface.name)) {
+        window->m_subcompositor = static_cast<wl_subcompositor *>(
+                    wl_registry_bind(registry, name, &wl_subcompositor_interface, 1));
+    } else if (!strcmp(interface, wl_shm_interface.name)) {
+        window->m_shm = static_cast<wl_shm *>(wl_registry_bind(registry, name, &wl_shm_interface, 1));
+    } else if (!strcmp(interface, wl_shell_interface.name)) {
+        window->m_shell = static_cast<wl_shell *>(wl_registry_bind(registry, name, &wl_shell_interface, 1));
+    }
+}
+
+void SyntheticWindow::registryGlobalRemove(void *, wl_registry *, uint32_t)
+{
+}
+
+void SyntheticWindow::shellSurfacePing(void *, wl_shell_surface *shellSurface, uint32_t serial)
+{
+    wl_shell_surface_pong(shellSurface, serial);
+}
+
+void SyntheticWindow::shellSurfaceConfigure(void *, wl_shell_surface *, uint32_t, int32_t, int32_t)
+{
+}
+
+void SyntheticWindow::shellSurfacePopupDone(void *, wl_shell_surface *)
+{
+}
+
+void SyntheticWindow::bufferRelease(void *data, wl_buffer *)
+{
+    static_cast<Buffer *>(data)->busy = false;
+}
+
+void SyntheticWindow::frameDone(void *data, wl_callback *callback, uint32_t)
+{
+    SyntheticWindow *window = static_cast<SyntheticWindow *>(data);
+
+    window->m_latencies.append(now() - window->m_commitTime);
+    window->m_frames++;
+    wl_callback_destroy(callback);
+    window->m_frameCallback = nullptr;
+
+    if (window->m_config.commitRate == 0)
+        window->redraw();
+}
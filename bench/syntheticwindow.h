@@ -0,0 +1,130 @@
+#ifndef SYNTHETICWINDOW_H
+#define SYNTHETICWINDOW_H
+
+#include <QObject>
+#include <QSize>
+#include <QRect>
+#include <QVector>
+#include <QByteArray>
+
+struct wl_display;
+struct wl_registry;
+struct wl_compositor;
+struct wl_subcompositor;
+struct wl_shm;
+struct wl_shell;
+struct wl_shell_surface;
+struct wl_surface;
+struct wl_subsurface;
+struct wl_buffer;
+struct wl_callback;
+class QSocketNotifier;
+class QTimer;
+
+struct WindowConfig
+{
+    enum Damage {
+        // Repaint the whole window every frame
+        FullDamage,
+        // A small square moving across the window
+        RectDamage,
+        // A strip of rows moving down the window
+        ScrollDamage,
+        // Commit without damage
+        NoDamage,
+        DamageCount
+    };
+
+    // Names used on the command line, indexed by Damage
+    static const char *const damageNames[DamageCount];
+
+    QSize size;
+    // Commits per second at most, 0 to commit on every frame callback
+    int commitRate;
+    Damage damage;
+    // Length of the chain of subsurfaces below the toplevel surface
+    int subsurfaceDepth;
+    // Subsurfaces of the toplevel surface laid out in a grid covering it
+    int tiles;
+};
+
+// A synthetic client with a connection of its own, showing one wl_shell
+// toplevel surface, a chain of subsurfaces and a grid of tiles, all
+// backed by translucent wl_shm buffers. Only the toplevel surface is redrawn, and never while its
+// last frame callback is outstanding.
+class SyntheticWindow : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SyntheticWindow(const WindowConfig &config, QObject *parent = nullptr);
+    ~SyntheticWindow();
+
+    // Returns false if the compositor is not there (yet)
+    bool connectTo(const QByteArray &socketName);
+    void start();
+
+    quint64 commits() const { return m_commits; }
+    quint64 skippedCommits() const { return m_skippedCommits; }
+    quint64 frames() const { return m_frames; }
+    // Time from each commit to its frame callback, in ns
+    const QVector<qint64> &latencies() const { return m_latencies; }
+    void resetCounters();
+
+signals:
+    void failed();
+
+private:
+    struct Buffer {
+        wl_buffer *buffer;
+        uchar *data;
+        bool busy;
+    };
+
+    struct Surface {
+        wl_surface *surface;
+        wl_subsurface *subsurface;
+        QSize size;
+        Buffer buffers[2];
+    };
+
+    static void registryGlobal(void *data, wl_registry *registry, uint32_t name,
+                               const char *interface, uint32_t version);
+    static void registryGlobalRemove(void *data, wl_registry *registry, uint32_t name);
+    static void shellSurfacePing(void *data, wl_shell_surface *shellSurface, uint32_t serial);
+    static void shellSurfaceConfigure(void *data, wl_shell_surface *shellSurface, uint32_t edges,
+                                      int32_t width, int32_t height);
+    static void shellSurfacePopupDone(void *data, wl_shell_surface *shellSurface);
+    static void bufferRelease(void *data, wl_buffer *buffer);
+    static void frameDone(void *data, wl_callback *callback, uint32_t time);
+
+    bool createBuffers();
+    void fill(const Buffer &buffer, const QSize &size, const QRect &rect, quint32 color);
+    void redraw();
+    void dispatch();
+
+    WindowConfig m_config;
+    wl_display *m_display;
+    wl_registry *m_registry;
+    wl_compositor *m_compositor;
+    wl_subcompositor *m_subcompositor;
+    wl_shm *m_shm;
+    wl_shell *m_shell;
+    wl_shell_surface *m_shellSurface;
+    wl_callback *m_frameCallback;
+    QVector<Surface> m_surfaces;
+    uchar *m_pool;
+    size_t m_poolSize;
+
+    QSocketNotifier *m_notifier;
+    QTimer *m_commitTimer;
+    QRect m_lastDamage;
+    quint32 m_step;
+    qint64 m_commitTime;
+
+    quint64 m_commits;
+    quint64 m_skippedCommits;
+    quint64 m_frames;
+    QVector<qint64> m_latencies;
+};
+
+#endif // SYNTHETICWINDOW_H
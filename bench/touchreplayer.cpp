@@ -0,0 +1,161 @@
+#include "touchreplayer.h"
+
+#include <QFile>
+#include <QtMath>
+#include <QDebug>
+
+#include <linux/input.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <cstring>
+
+// Size of the compositor's window, which positions are relative to
+static const int outputWidth = 800;
+static const int outputHeight = 1280;
+// Frames per second a fast touchscreen reports
+static const int frameRate = 240;
+// Frames from the fingers going down to them being lifted
+static const int gestureFrames = 60;
+// Distance between neighbouring fingers when they go down
+static const qreal fingerSpacing = 80;
+
+// Spreads the bits of x, for positions that look random but are the
+// same in every run
+static quint32 scramble(quint32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+TouchReplayer::TouchReplayer(const QString &path, Pattern pattern, int fingers, QObject *parent)
+    : QObject(parent)
+    , m_path(path)
+    , m_pattern(pattern)
+    , m_fingers(pattern == TapPattern ? 1 : qBound(1, fingers, 10))
+    , m_fd(-1)
+    , m_step(0)
+    , m_gesture(0)
+    , m_frames(0)
+    , m_stalledFrames(0)
+{
+    m_timer.setTimerType(Qt::PreciseTimer);
+    m_timer.setInterval(1000 / frameRate);
+    connect(&m_timer, &QTimer::timeout, this, &TouchReplayer::writeFrame);
+}
+
+TouchReplayer::~TouchReplayer()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    QFile::remove(m_path);
+}
+
+bool TouchReplayer::create()
+{
+    QFile::remove(m_path);
+    if (mkfifo(QFile::encodeName(m_path).constData(), 0600) < 0) {
+        qWarning() << "Failed to create" << m_path << ":" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool TouchReplayer::open()
+{
+    // Frames are far smaller than PIPE_BUF, so each write is atomic and
+    // a full pipe drops whole frames
+    m_fd = ::open(QFile::encodeName(m_path).constData(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (m_fd < 0) {
+        qWarning() << "Failed to open" << m_path << ":" << strerror(errno);
+        return false;
+    }
+
+    // Writes fail with EPIPE instead if the compositor goes away
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+}
+
+void TouchReplayer::start()
+{
+    m_timer.start();
+}
+
+void TouchReplayer::resetCounters()
+{
+    m_frames = 0;
+    m_stalledFrames = 0;
+}
+
+void TouchReplayer::appendEvent(QByteArray *data, quint16 type, quint16 code, qint32 value)
+{
+    struct input_event event;
+    memset(&event, 0, sizeof(event));
+    gettimeofday(&event.time, nullptr);
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    data->append(reinterpret_cast<const char *>(&event), int(sizeof(event)));
+}
+
+// Even gestures swipe all fingers upwards, odd ones spread them apart
+// from their center. A tap is a gesture of two frames that stays put.
+void TouchReplayer::writeFrame()
+{
+    const int frames = m_pattern == TapPattern ? 2 : gestureFrames;
+
+    if (m_step == 0 && m_pattern == TapPattern) {
+        m_center = QPointF(scramble(2 * m_gesture) % outputWidth, scramble(2 * m_gesture + 1) % outputHeight);
+    } else if (m_step == 0) {
+        const qreal span = (m_fingers - 1) * fingerSpacing;
+        m_center = QPointF(span / 2 + 40 + (m_gesture * 97) % quint32(qMax(1.0, outputWidth - span - 80)),
+                           400 + (m_gesture * 193) % quint32(outputHeight - 440));
+    }
+
+    const bool lifting = m_step == frames - 1;
+    const qreal progress = qreal(m_step) / frames;
+
+    QByteArray data;
+    for (int i = 0; i < m_fingers; i++) {
+        const qreal offset = (i - (m_fingers - 1) / 2.0) * fingerSpacing;
+        QPointF pos;
+        if (m_pattern == TapPattern)
+            pos = m_center;
+        else if (m_gesture % 2 == 0)
+            pos = QPointF(m_center.x() + offset, m_center.y() - progress * 360);
+        else
+            pos = QPointF(m_center.x() + offset * (1 + progress), m_center.y() + offset * progress);
+
+        appendEvent(&data, EV_ABS, ABS_MT_SLOT, i);
+        if (m_step == 0)
+            appendEvent(&data, EV_ABS, ABS_MT_TRACKING_ID, qint32((m_gesture * m_fingers + i) & 0xffff));
+        if (lifting) {
+            appendEvent(&data, EV_ABS, ABS_MT_TRACKING_ID, -1);
+        } else {
+            appendEvent(&data, EV_ABS, ABS_MT_POSITION_X, qBound(0, qRound(pos.x()), outputWidth - 1));
+            appendEvent(&data, EV_ABS, ABS_MT_POSITION_Y, qBound(0, qRound(pos.y()), outputHeight - 1));
+        }
+    }
+    appendEvent(&data, EV_SYN, SYN_REPORT, 0);
+
+    // A frame that did not fit is written again with the next tick, so
+    // that no finger goes down or up unnoticed
+    if (write(m_fd, data.constData(), size_t(data.size())) != data.size()) {
+        m_stalledFrames++;
+        return;
+    }
+    m_frames++;
+
+    if (++m_step == frames) {
+        m_step = 0;
+        m_gesture++;
+    }
+}
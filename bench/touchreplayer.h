@@ -0,0 +1,62 @@
+#ifndef TOUCHREPLAYER_H
+#define TOUCHREPLAYER_H
+
+#include <QObject>
+#include <QString>
+#include <QTimer>
+#include <QPointF>
+#include <QVector>
+
+// Feeds synthetic touch input to the compositor through a FIFO that it
+// reads as an evdev device, listed in NUBBOCK_EVDEV_DEVICES. Every frame
+// of touch events is written in one go, like a touchscreen reporting at
+// a fixed rate. Positions are window pixels.
+class TouchReplayer : public QObject
+{
+    Q_OBJECT
+public:
+    enum Pattern {
+        // Multi-finger gestures at varying places, alternating between
+        // swipes and pinches
+        GesturePattern,
+        // Single-finger taps at random places, lifted with the next frame
+        TapPattern
+    };
+
+    // fingers is only used by gestures
+    TouchReplayer(const QString &path, Pattern pattern, int fingers, QObject *parent = nullptr);
+    ~TouchReplayer();
+
+    // Creates the FIFO, before the compositor is started
+    bool create();
+    // Opens the FIFO for writing, which only works once the compositor
+    // has opened it for reading
+    bool open();
+    void start();
+
+    // Frames written, and attempts that found the FIFO full because the
+    // compositor did not keep up reading
+    quint64 frames() const { return m_frames; }
+    quint64 stalledFrames() const { return m_stalledFrames; }
+    void resetCounters();
+
+private:
+    void writeFrame();
+    void appendEvent(QByteArray *data, quint16 type, quint16 code, qint32 value);
+
+    const QString m_path;
+    const Pattern m_pattern;
+    const int m_fingers;
+    int m_fd;
+    QTimer m_timer;
+
+    // Frame within the current gesture, and the number of gestures so far
+    int m_step;
+    quint32 m_gesture;
+    QPointF m_center;
+
+    quint64 m_frames;
+    quint64 m_stalledFrames;
+};
+
+#endif // TOUCHREPLAYER_H
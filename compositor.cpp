@@ -49,6 +49,11 @@
 ****************************************************************************/
 
 #include "compositor.h"
+#include "textureuploader.h"
+#include "quadrenderer.h"
+#include "trace.h"
+#include "presentationtime.h"
+#include "viewporter.h"
 
 #include <QMouseEvent>
 #include <QKeyEvent>
@@ -58,38 +63,172 @@
 #include <QtWaylandCompositor/QWaylandWlShellSurface>
 #include <QtWaylandCompositor/qwaylandseat.h>
 #include <QtWaylandCompositor/qwaylanddrag.h>
+#include <QtWaylandCompositor/private/qwaylandsurface_p.h>
 
 #include <QDebug>
 #include <QOpenGLContext>
+#include <QOpenGLTexture>
+#include <QLoggingCategory>
+#include <QScreen>
+
+#include <wayland-server.h>
 
 #ifndef GL_TEXTURE_EXTERNAL_OES
 #define GL_TEXTURE_EXTERNAL_OES 0x8D65
 #endif
 
+Q_LOGGING_CATEGORY(lcFrames, "nubbock.frames")
+
+// Views kept for reuse at most
+static const int maxPooledViews = 32;
+// Surfaces that are hidden get frame callbacks this often at most, in ns
+static const qint64 hiddenFrameCallbackInterval = 1000000000;
+
 View::View(Compositor *compositor)
     : m_compositor(compositor)
     , m_textureTarget(GL_TEXTURE_2D)
     , m_texture(0)
+    , m_shmTexture(nullptr)
+    , m_textureDirty(false)
+    , m_bufferAttached(false)
+    , m_bufferOpaque(false)
+    , m_culled(false)
     , m_wlShellSurface(nullptr)
     , m_xdgSurface(nullptr)
     , m_xdgPopup(nullptr)
     , m_parentView(nullptr)
+    , m_firstChild(nullptr)
+    , m_lastChild(nullptr)
+    , m_prevSibling(nullptr)
+    , m_nextSibling(nullptr)
+    , m_stackingIndex(0)
+    , m_absolutePositionDirty(true)
+    , m_transformAngle(0.0f)
+    , m_lastFrameCallback(0)
+    , m_enteredOutput(false)
 {}
 
-QOpenGLTexture *View::getTexture()
+// Returns the view to the state of a freshly constructed one, so that it
+// can be handed out for another surface.
+void View::recycle()
 {
-    if (advance()) {
-        QWaylandBufferRef buf = currentBuffer();
-        m_texture = buf.toOpenGLTexture();
-        if (surface()) {
-            m_size = surface()->size();
-            m_origin = buf.origin() == QWaylandSurface::OriginTopLeft
-                    ? QOpenGLTextureBlitter::OriginTopLeft
-                    : QOpenGLTextureBlitter::OriginBottomLeft;
-        }
+    if (surface())
+        surface()->disconnect(this);
+    if (m_xdgSurface)
+        m_xdgSurface->disconnect(this);
+    setSurface(nullptr);
+
+    if (m_shmTexture) {
+        m_shmTexture->release();
+        m_shmTexture = nullptr;
+    }
+    m_texture = nullptr;
+    m_textureTarget = GL_TEXTURE_2D;
+    m_textureDirty = false;
+    m_bufferAttached = false;
+    m_bufferOpaque = false;
+    m_culled = false;
+    m_origin = QOpenGLTextureBlitter::OriginTopLeft;
+    m_position = QPointF();
+    m_size = QSize();
+    m_viewportSource = QRectF();
+    m_viewportDestination = QSize();
+    m_wlShellSurface = nullptr;
+    m_xdgSurface = nullptr;
+    m_xdgPopup = nullptr;
+    m_offset = QPoint();
+    m_damage = QRegion();
+    m_bufferDamage = QRegion();
+    m_paintedRect = QRect();
+    m_stackingIndex = 0;
+    m_absolutePositionDirty = true;
+    m_lastFrameCallback = 0;
+    m_enteredOutput = false;
+    m_transformGeometry = QRectF();
+    m_transformViewport = QSize();
+}
+
+View::~View()
+{
+    if (m_shmTexture)
+        m_shmTexture->release();
+}
+
+bool View::advance()
+{
+    if (!QWaylandView::advance())
+        return false;
+
+    QWaylandBufferRef buf = currentBuffer();
+    m_textureDirty = true;
+    if (surface()) {
+        m_size = surface()->size();
+        m_origin = buf.origin() == QWaylandSurface::OriginTopLeft
+                ? QOpenGLTextureBlitter::OriginTopLeft
+                : QOpenGLTextureBlitter::OriginBottomLeft;
     }
 
-    return m_texture;
+    if (buf.isSharedMemory())
+        m_bufferOpaque = !buf.image().hasAlphaChannel();
+    else
+        m_bufferOpaque = buf.bufferFormatEgl() == QWaylandBufferRef::BufferFormatEgl_RGB;
+
+    return true;
+}
+
+// The texture is only updated when it is about to be drawn, so views
+// that are culled don't cost an upload. Shared memory buffers are copied
+// into compositor-owned textures by the uploader, other buffers are
+// handed to QtWayland.
+void View::updateTexture(TextureUploader *uploader)
+{
+    advance();
+
+    if (!m_textureDirty)
+        return;
+    m_textureDirty = false;
+
+    QWaylandBufferRef buf = currentBuffer();
+    if (buf.isSharedMemory()) {
+        if (!m_shmTexture)
+            m_shmTexture = uploader->createTexture();
+        uploader->upload(m_shmTexture, buf, m_bufferDamage, m_bufferAttached);
+        m_bufferDamage = QRegion();
+        m_bufferAttached = false;
+        m_texture = nullptr;
+        m_textureTarget = GL_TEXTURE_2D;
+        return;
+    }
+
+    if (m_shmTexture) {
+        m_shmTexture->release();
+        m_shmTexture = nullptr;
+    }
+
+    m_bufferDamage = QRegion();
+    m_bufferAttached = false;
+    m_texture = buf.toOpenGLTexture();
+    m_textureTarget = m_texture ? GLenum(m_texture->target()) : GLenum(GL_TEXTURE_2D);
+}
+
+GLuint View::textureId() const
+{
+    if (m_texture)
+        return m_texture->textureId();
+    return m_shmTexture ? m_shmTexture->textureId() : 0;
+}
+
+bool View::isContentPending() const
+{
+    return m_textureDirty || (m_shmTexture && m_shmTexture->isUploading());
+}
+
+int View::buffersHeld() const
+{
+    int held = m_shmTexture ? m_shmTexture->buffersHeld() : 0;
+    if ((m_textureDirty && m_bufferAttached) || (!m_shmTexture && !currentBuffer().isNull()))
+        held++;
+    return held;
 }
 
 QOpenGLTextureBlitter::Origin View::textureOrigin() const
@@ -99,14 +238,174 @@ QOpenGLTextureBlitter::Origin View::textureOrigin() const
 
 QSize View::size() const
 {
+    if (m_viewportDestination.isValid())
+        return m_viewportDestination;
+    if (!m_viewportSource.isNull())
+        return m_viewportSource.size().toSize();
     return surface() ? surface()->size() : m_size;
 }
 
+void View::setViewport(const QRectF &source, const QSize &destination)
+{
+    if (source == m_viewportSource && destination == m_viewportDestination)
+        return;
+
+    m_viewportSource = source;
+    m_viewportDestination = destination;
+
+    // Damage from before no longer maps to the buffer the way it did
+    m_damage += QRect(QPoint(), size());
+    m_bufferDamage += QRect(QPoint(), surface() ? surface()->size() : m_size);
+    m_compositor->viewGeometryChanged(this);
+}
+
+// The texture holds the buffer that was latched last, of m_size
+QRectF View::textureRect() const
+{
+    if (m_viewportSource.isNull() || m_size.isEmpty())
+        return QRectF(0, 0, 1, 1);
+
+    return QRectF(m_viewportSource.x() / m_size.width(), m_viewportSource.y() / m_size.height(),
+                  m_viewportSource.width() / m_size.width(), m_viewportSource.height() / m_size.height());
+}
+
+// Maps surface-local coordinates to those of the buffer. Scaled damage is
+// rounded outwards to whole buffer pixels.
+QRegion View::mapToBuffer(const QRegion &region) const
+{
+    if (m_viewportSource.isNull() && !m_viewportDestination.isValid())
+        return region;
+
+    const QSize surfaceSize = size();
+    const QSize bufferSize = surface() ? surface()->size() : m_size;
+    if (surfaceSize.isEmpty())
+        return QRegion();
+
+    const QRectF source = m_viewportSource.isNull() ? QRectF(QPointF(), bufferSize) : m_viewportSource;
+    const qreal sx = source.width() / surfaceSize.width();
+    const qreal sy = source.height() / surfaceSize.height();
+
+    QRegion mapped;
+    for (const QRect &r : region)
+        mapped += QRectF(source.x() + r.x() * sx, source.y() + r.y() * sy,
+                         r.width() * sx, r.height() * sy).toAlignedRect();
+    return mapped;
+}
+
+// Whether the viewport shows the buffer larger than it is, in either
+// direction
+bool View::isUpscaled() const
+{
+    if (m_viewportSource.isNull() && !m_viewportDestination.isValid())
+        return false;
+
+    const QSize bufferSize = surface() ? surface()->size() : m_size;
+    const QSizeF source = m_viewportSource.isNull() ? QSizeF(bufferSize) : m_viewportSource.size();
+    const QSize surfaceSize = size();
+    return surfaceSize.width() > source.width() || surfaceSize.height() > source.height();
+}
+
 bool View::isCursor() const
 {
     return surface() && surface()->isCursorSurface();
 }
 
+bool View::isMapped() const
+{
+    return ((surface() && surface()->hasContent()) || isBufferLocked()) && !size().isEmpty();
+}
+
+// Part of the view, in surface-local coordinates, that is known to be
+// fully opaque. Either the client said so, or the buffer has no alpha.
+QRegion View::opaqueRegion() const
+{
+    if (!surface())
+        return QRegion();
+
+    const QRect rect(QPoint(), size());
+    if (m_bufferOpaque)
+        return rect;
+
+    return QWaylandSurfacePrivate::get(surface())->opaqueRegion & rect;
+}
+
+bool View::isOpaque() const
+{
+    return (QRegion(QRect(QPoint(), size())) - opaqueRegion()).isEmpty();
+}
+
+QRegion View::takeDamage()
+{
+    QRegion damage = m_damage;
+    m_damage = QRegion();
+    return damage;
+}
+
+// Damage is tracked twice: once for repainting the output, and once for
+// what needs to be uploaded from the buffer, which may lag behind when the
+// view is culled.
+//
+// QtWayland clips damage to the buffer size before reporting it, so when
+// the viewport scales the buffer up, damage beyond the top-left corner
+// is lost. A commit attaching a buffer then damages the whole view.
+void View::onDamaged(const QRegion &region)
+{
+    // QtWayland only knows while the commit is being applied, damage is
+    // reported during that
+    const bool attached = QWaylandSurfacePrivate::get(surface())->pending.newlyAttached;
+    if (attached)
+        m_bufferAttached = true;
+
+    if (attached && isUpscaled()) {
+        m_damage += QRect(QPoint(), size());
+        m_bufferDamage += QRect(QPoint(), surface()->size());
+        return;
+    }
+
+    m_damage += region;
+    m_bufferDamage += mapToBuffer(region);
+}
+
+void View::onSizeChanged()
+{
+    m_compositor->viewGeometryChanged(this);
+}
+
+void View::setPosition(const QPointF &pos)
+{
+    if (pos == m_position)
+        return;
+
+    m_position = pos;
+    m_compositor->viewGeometryChanged(this);
+}
+
+QPointF View::absolutePosition() const
+{
+    if (m_absolutePositionDirty) {
+        m_absolutePosition = parentPosition() + m_position;
+        m_absolutePositionDirty = false;
+    }
+    return m_absolutePosition;
+}
+
+QTransform View::outputTransform(const QSize &viewport, float angle) const
+{
+    const QRectF geometry = this->geometry();
+    if (geometry != m_transformGeometry || viewport != m_transformViewport || angle != m_transformAngle) {
+        m_outputTransform = QuadRenderer::outputTransform(geometry, viewport, angle);
+        m_transformGeometry = geometry;
+        m_transformViewport = viewport;
+        m_transformAngle = angle;
+    }
+    return m_outputTransform;
+}
+
+void View::setParentView(View *parent)
+{
+    m_compositor->setParentView(this, parent);
+}
+
 
 void View::onXdgSetMaximized()
 {
@@ -153,9 +452,25 @@ void View::onXdgUnsetFullscreen()
 Compositor::Compositor(QWindow *window)
     : QWaylandCompositor()
     , m_window(window)
+    , m_firstView(nullptr)
+    , m_lastView(nullptr)
+    , m_stackingDirty(false)
+    , m_viewsAllocated(0)
+    , m_viewsReused(0)
+    , m_frameClock(new FrameClock(this))
+    , m_presentationTime(nullptr)
+    , m_viewporter(nullptr)
     , m_wlShell(new QWaylandWlShell(this))
     , m_xdgShell(new QWaylandXdgShellV5(this))
+    , m_cursorView(nullptr)
+    , m_throttledSurfaces(0)
+    , m_frameCallbacksHeld(false)
 {
+    m_keepaliveTimer.setSingleShot(true);
+    connect(&m_keepaliveTimer, &QTimer::timeout, this, [this]() {
+        sendFrameCallbacks(true);
+    });
+
     connect(m_wlShell, &QWaylandWlShell::wlShellSurfaceCreated, this, &Compositor::onWlShellSurfaceCreated);
     connect(m_xdgShell, &QWaylandXdgShellV5::xdgSurfaceCreated, this, &Compositor::onXdgSurfaceCreated);
     connect(m_xdgShell, &QWaylandXdgShellV5::xdgPopupRequested, this, &Compositor::onXdgPopupRequested);
@@ -163,6 +478,33 @@ Compositor::Compositor(QWindow *window)
 
 Compositor::~Compositor()
 {
+    qDeleteAll(m_viewPool);
+}
+
+View *Compositor::createView()
+{
+    if (!m_viewPool.isEmpty()) {
+        m_viewsReused++;
+        return m_viewPool.takeLast();
+    }
+
+    m_viewsAllocated++;
+    return new View(this);
+}
+
+// Surfaces come and go all the time for tooltips, popups and cursors, so
+// their views are kept around for reuse.
+void Compositor::recycleView(View *view)
+{
+    emit viewRemoved(view);
+
+    if (m_viewPool.count() >= maxPooledViews) {
+        delete view;
+        return;
+    }
+
+    view->recycle();
+    m_viewPool.append(view);
 }
 
 void Compositor::create()
@@ -172,8 +514,14 @@ void Compositor::create()
     output->addMode(mode, true);
     QWaylandCompositor::create();
     output->setCurrentMode(mode);
+    m_presentationTime = new PresentationTime(this);
+    m_viewporter = new Viewporter(this);
 
     setDefaultOutput(output);
+    m_spatialIndex.setBounds(output->geometry());
+
+    if (m_window->screen())
+        m_frameClock->setRefreshRate(m_window->screen()->refreshRate());
 
     output->setTransform(QWaylandOutput::Transform270);
 
@@ -187,17 +535,20 @@ void Compositor::onSurfaceCreated(QWaylandSurface *surface)
 {
     connect(surface, &QWaylandSurface::surfaceDestroyed, this, &Compositor::surfaceDestroyed);
     connect(surface, &QWaylandSurface::hasContentChanged, this, &Compositor::surfaceHasContentChanged);
-    connect(surface, &QWaylandSurface::redraw, this, &Compositor::triggerRender);
+    connect(surface, &QWaylandSurface::redraw, this, &Compositor::onSurfaceCommitted);
     connect(surface, &QWaylandSurface::subsurfacePositionChanged, this, &Compositor::onSubsurfacePositionChanged);
 
-    View *view = new View(this);
+    View *view = createView();
     view->setSurface(surface);
     view->setOutput(outputFor(m_window));
 
     outputFor(m_window)->setTransform(QWaylandOutput::Transform270);
 
-    m_views << view;
+    linkView(view, nullptr);
+    m_viewsBySurface.insert(surface, view);
     connect(surface, &QWaylandSurface::offsetForNextFrame, view, &View::onOffsetForNextFrame);
+    connect(surface, &QWaylandSurface::damaged, view, &View::onDamaged);
+    connect(surface, &QWaylandSurface::sizeChanged, view, &View::onSizeChanged);
 }
 
 void Compositor::surfaceHasContentChanged()
@@ -218,11 +569,22 @@ void Compositor::surfaceDestroyed()
     QWaylandSurface *surface = qobject_cast<QWaylandSurface*>(sender());
     View *view = findView(surface);
 
-    qInfo() << "SURFACE DESTROYED" << surface << "view" << view;
+    TRACE_INSTANT(Surface, "destroyed", 0);
 
     if (view) {
-        m_views.removeAll(view);
-        delete view;
+        addDamage(view->paintedRect());
+
+        if (view == m_cursorView)
+            m_cursorView = nullptr;
+
+        // Orphaned subsurfaces end up on top level until they go away too
+        while (View *child = view->m_firstChild)
+            setParentView(child, nullptr);
+
+        unlinkView(view);
+        m_viewsBySurface.remove(surface);
+        m_spatialIndex.remove(view);
+        recycleView(view);
     }
 
     triggerRender();
@@ -230,11 +592,7 @@ void Compositor::surfaceDestroyed()
 
 View * Compositor::findView(const QWaylandSurface *s) const
 {
-    Q_FOREACH (View* view, m_views) {
-        if (view->surface() == s)
-            return view;
-    }
-    return Q_NULLPTR;
+    return m_viewsBySurface.value(s);
 }
 
 void Compositor::onWlShellSurfaceCreated(QWaylandWlShellSurface *wlShellSurface)
@@ -346,13 +704,22 @@ void Compositor::onSubsurfacePositionChanged(const QPoint &position)
     triggerRender();
 }
 
+void Compositor::onSurfaceCommitted()
+{
+    TRACE_INSTANT(Surface, "commit", 0);
+    m_frameClock->commitReceived();
+    triggerRender();
+}
+
 void Compositor::triggerRender()
 {
-    m_window->requestUpdate();
+    m_frameClock->scheduleFrame();
 }
 
 void Compositor::startRender()
 {
+    m_frameClock->renderStarted();
+
     QWaylandOutput *out = defaultOutput();
     if (out)
         out->frameStarted();
@@ -360,34 +727,132 @@ void Compositor::startRender()
 
 void Compositor::endRender()
 {
-    QWaylandOutput *out = defaultOutput();
-    if (out)
-        out->sendFrameCallbacks();
+    m_frameClock->renderFinished();
+    m_presentationTime->frameRendered();
 }
 
-void Compositor::updateCursor()
+// Frame callbacks go out once the frame is on screen, so that clients
+// start drawing at the beginning of a refresh cycle.
+void Compositor::framePresented()
 {
-    m_cursorView.advance();
-    QImage image = m_cursorView.currentBuffer().image();
-    if (!image.isNull())
-        m_window->setCursor(QCursor(QPixmap::fromImage(image), m_cursorHotspotX, m_cursorHotspotY));
+    m_frameClock->framePresented();
+    TRACE_INSTANT(Frame, "present", m_frameClock->missedFrames());
+
+    qCDebug(lcFrames) << "Frame presented, render time" << m_frameClock->lastRenderTime() / 1000
+                      << "us, predicted" << m_frameClock->predictedRenderTime() / 1000
+                      << "us, commit to present latency" << m_frameClock->lastCommitLatency() / 1000
+                      << "us, missed frames" << m_frameClock->missedFrames();
+
+    m_presentationTime->framePresented(defaultOutput(), m_frameClock->lastPresentationTime(),
+                                       m_frameClock->refreshInterval());
+    sendFrameCallbacks(false);
 }
 
-void Compositor::adjustCursorSurface(QWaylandSurface *surface, int hotspotX, int hotspotY)
+// Frame callbacks only go to surfaces that were visible in the frame just
+// presented. Those culled behind opaque surfaces or outside of the output
+// are kept alive at a low rate instead, so they stop animating at full
+// rate but don't stall either. With hiddenOnly, only those are served.
+void Compositor::sendFrameCallbacks(bool hiddenOnly)
 {
-    if ((m_cursorView.surface() != surface)) {
-        if (m_cursorView.surface())
-            disconnect(m_cursorView.surface(), &QWaylandSurface::redraw, this, &Compositor::updateCursor);
-        if (surface)
-            connect(surface, &QWaylandSurface::redraw, this, &Compositor::updateCursor);
+    if (m_frameCallbacksHeld)
+        return;
+
+    const qint64 now = FrameClock::now();
+    int throttled = 0;
+
+    Q_FOREACH (View *view, views()) {
+        QWaylandSurface *surface = view->surface();
+        if (!surface || !surface->hasContent())
+            continue;
+
+        // As QWaylandOutput::sendFrameCallbacks() would, which is not used
+        // so that hidden surfaces can be left out
+        if (!view->m_enteredOutput) {
+            if (QWaylandOutput *out = view->output() ? view->output() : defaultOutput())
+                out->surfaceEnter(surface);
+            view->m_enteredOutput = true;
+        }
+
+        if (hiddenOnly && !view->isCulled())
+            continue;
+
+        if (view->isCulled() && now - view->m_lastFrameCallback < hiddenFrameCallbackInterval) {
+            throttled++;
+            continue;
+        }
+
+        view->m_lastFrameCallback = now;
+        surface->sendFrameCallbacks();
     }
 
-    m_cursorView.setSurface(surface);
-    m_cursorHotspotX = hotspotX;
-    m_cursorHotspotY = hotspotY;
+    m_throttledSurfaces = throttled;
+    wl_display_flush_clients(display());
 
-    if (surface && surface->hasContent())
-        updateCursor();
+    if (throttled && !m_keepaliveTimer.isActive())
+        m_keepaliveTimer.start(int(hiddenFrameCallbackInterval / 1000000));
+}
+
+void Compositor::setFrameCallbacksHeld(bool held)
+{
+    m_frameCallbacksHeld = held;
+    if (held)
+        m_keepaliveTimer.stop();
+}
+
+QRegion Compositor::takeDamage()
+{
+    QRegion damage = m_outputDamage;
+    m_outputDamage = QRegion();
+    return damage;
+}
+
+QHash<QWaylandClient*, int> Compositor::buffersHeld() const
+{
+    QHash<QWaylandClient*, int> held;
+    Q_FOREACH (View *view, views()) {
+        if (view->surface())
+            held[view->surface()->client()] += view->buffersHeld();
+    }
+    return held;
+}
+
+// Offsets the client attaches cursor buffers with accumulate in the
+// position of the view, and move the image against the hotspot.
+QRectF Compositor::cursorGeometry() const
+{
+    if (!m_cursorView || !m_cursorView->isMapped())
+        return QRectF();
+
+    return QRectF(m_cursorPosition - m_cursorHotspot + m_cursorView->position(), m_cursorView->size());
+}
+
+void Compositor::setCursorPosition(const QPointF &pos)
+{
+    if (pos == m_cursorPosition)
+        return;
+
+    m_cursorPosition = pos;
+    if (m_cursorView)
+        triggerRender();
+}
+
+// The cursor image is composited like any other surface, so commits of
+// the cursor surface only upload what changed and pointer motion just
+// repaints the area the cursor left and entered. The platform cursor
+// stays hidden.
+void Compositor::adjustCursorSurface(QWaylandSurface *surface, int hotspotX, int hotspotY)
+{
+    View *view = surface ? findView(surface) : nullptr;
+    if (view != m_cursorView || m_cursorHotspot != QPointF(hotspotX, hotspotY)) {
+        m_cursorView = view;
+        if (m_cursorView)
+            m_cursorView->setPosition(QPointF());
+        m_cursorHotspot = QPointF(hotspotX, hotspotY);
+        triggerRender();
+    }
+
+    if (m_window->cursor().shape() != Qt::BlankCursor)
+        m_window->setCursor(Qt::BlankCursor);
 }
 
 void Compositor::closePopups()
@@ -459,35 +924,116 @@ QWaylandClient *Compositor::popupClient() const
     return client ? client : m_xdgShell->popupClient();
 }
 
-// We only have a flat list of views, plus pointers from child to parent,
-// so maintaining a stacking order gets a bit complex. A better data
-// structure is left as an exercise for the reader.
+void Compositor::linkView(View *view, View *parent)
+{
+    View *&first = parent ? parent->m_firstChild : m_firstView;
+    View *&last = parent ? parent->m_lastChild : m_lastView;
+
+    view->m_parentView = parent;
+    view->m_prevSibling = last;
+    view->m_nextSibling = nullptr;
+    if (last)
+        last->m_nextSibling = view;
+    else
+        first = view;
+    last = view;
+
+    m_stackingDirty = true;
+}
 
-static int findEndOfChildTree(const QList<View*> &list, int index)
+void Compositor::unlinkView(View *view)
 {
-    int n = list.count();
-    View *parent = list.at(index);
-    while (index + 1 < n) {
-        if (list.at(index+1)->parentView() != parent)
-            break;
-        index = findEndOfChildTree(list, index + 1);
+    View *parent = view->m_parentView;
+    View *&first = parent ? parent->m_firstChild : m_firstView;
+    View *&last = parent ? parent->m_lastChild : m_lastView;
+
+    if (view->m_prevSibling)
+        view->m_prevSibling->m_nextSibling = view->m_nextSibling;
+    else
+        first = view->m_nextSibling;
+    if (view->m_nextSibling)
+        view->m_nextSibling->m_prevSibling = view->m_prevSibling;
+    else
+        last = view->m_prevSibling;
+
+    view->m_parentView = nullptr;
+    view->m_prevSibling = nullptr;
+    view->m_nextSibling = nullptr;
+
+    m_stackingDirty = true;
+}
+
+void Compositor::setParentView(View *view, View *parent)
+{
+    if (view->m_parentView == parent)
+        return;
+
+    // Refuse to create a cycle
+    for (View *ancestor = parent; ancestor; ancestor = ancestor->m_parentView) {
+        if (ancestor == view)
+            return;
     }
-    return index;
+
+    unlinkView(view);
+    linkView(view, parent);
+    viewGeometryChanged(view);
 }
 
+void Compositor::addSubtreeDamage(View *view)
+{
+    addDamage(view->paintedRect());
+    for (View *child = view->m_firstChild; child; child = child->m_nextSibling)
+        addSubtreeDamage(child);
+}
+
+// Moves the view to the top of its siblings, and so on up to the top
+// level, taking its children along.
 void Compositor::raise(View *view)
 {
-    int startPos = m_views.indexOf(view);
-    int endPos = findEndOfChildTree(m_views, startPos);
+    View *top = view;
+    while (top->m_parentView)
+        top = top->m_parentView;
+
+    // The raised tree now covers whatever was stacked above it
+    addSubtreeDamage(top);
 
-    int n = m_views.count();
-    int tail =  n - endPos - 1;
+    for (View *node = view; node; node = node->m_parentView) {
+        if (!node->m_nextSibling)
+            continue;
 
-    //bubble sort: move the child tree to the end of the list
-    for (int i = 0; i < tail; i++) {
-        int source = endPos + 1 + i;
-        int dest = startPos + i;
-        for (int j = source; j > dest; j--)
-            m_views.swap(j, j-1);
+        View *parent = node->m_parentView;
+        unlinkView(node);
+        linkView(node, parent);
     }
+
+    triggerRender();
+}
+
+void Compositor::appendSubtree(View *view) const
+{
+    view->m_stackingIndex = m_views.count();
+    m_views.append(view);
+    for (View *child = view->m_firstChild; child; child = child->m_nextSibling)
+        appendSubtree(child);
+}
+
+void Compositor::ensureStacking() const
+{
+    if (!m_stackingDirty)
+        return;
+
+    m_views.clear();
+    for (View *view = m_firstView; view; view = view->m_nextSibling)
+        appendSubtree(view);
+    m_stackingDirty = false;
+}
+
+// Children are positioned relative to their parent, so they move along.
+void Compositor::viewGeometryChanged(View *view)
+{
+    view->m_absolutePositionDirty = true;
+    m_spatialIndex.update(view, view->geometry());
+
+    for (View *child = view->m_firstChild; child; child = child->m_nextSibling)
+        viewGeometryChanged(child);
 }
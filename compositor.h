@@ -57,6 +57,11 @@
 #include <QtWaylandCompositor/QWaylandWlShellSurface>
 #include <QtWaylandCompositor/QWaylandXdgSurfaceV5>
 #include <QTimer>
+#include <QHash>
+#include <QVector>
+#include <QTransform>
+#include "frameclock.h"
+#include "spatialindex.h"
 #include <QOpenGLTextureBlitter>
 
 QT_BEGIN_NAMESPACE
@@ -66,38 +71,114 @@ class QWaylandWlShellSurface;
 class QWaylandXdgShellV5;
 class QOpenGLTexture;
 class Compositor;
+class ShmTexture;
+class TextureUploader;
+class PresentationTime;
+class Viewporter;
 
 class View : public QWaylandView
 {
     Q_OBJECT
 public:
     View(Compositor *compositor);
-    QOpenGLTexture *getTexture();
+    ~View();
+    bool advance() override;
+    void updateTexture(TextureUploader *uploader);
+    GLuint textureId() const;
+    GLenum textureTarget() const { return m_textureTarget; }
+    // True while the latest buffer has not made it into a texture yet
+    bool isContentPending() const;
+    // Client buffers the view keeps from being released, 0 or 1 for
+    // anything but shm buffers in flight
+    int buffersHeld() const;
     QOpenGLTextureBlitter::Origin textureOrigin() const;
     QPointF position() const { return m_position; }
-    void setPosition(const QPointF &pos) { m_position = pos; }
+    void setPosition(const QPointF &pos);
     QSize size() const;
     bool isCursor() const;
     bool hasShell() const { return m_wlShellSurface; }
-    void setParentView(View *parent) { m_parentView = parent; }
+    void setParentView(View *parent);
     View *parentView() const { return m_parentView; }
-    QPointF parentPosition() const { return m_parentView ? (m_parentView->position() + m_parentView->parentPosition()) : QPointF(); }
-    QSize windowSize() { return m_xdgSurface ? m_xdgSurface->windowGeometry().size() :  surface() ? surface()->size() : m_size; }
+    // Children are stacked above their parent, in sibling order
+    View *firstChild() const { return m_firstChild; }
+    View *nextSibling() const { return m_nextSibling; }
+    QPointF parentPosition() const { return m_parentView ? m_parentView->absolutePosition() : QPointF(); }
+    // Position in output coordinates, cached until the view or one of its
+    // ancestors moves
+    QPointF absolutePosition() const;
+    // Maps surface-local coordinates to normalized device coordinates of
+    // the output, see QuadRenderer::outputTransform()
+    QTransform outputTransform(const QSize &viewport, float angle) const;
+    QSize windowSize() { return m_xdgSurface ? m_xdgSurface->windowGeometry().size() : size(); }
     QPoint offset() const { return m_offset; }
+    // Absolute position and size in output coordinates
+    QRectF geometry() const { return QRectF(absolutePosition(), size()); }
+    // Position in the stacking order, higher is further up
+    int stackingIndex() const { return m_stackingIndex; }
+    bool isMapped() const;
+    QRegion opaqueRegion() const;
+    bool isOpaque() const;
+    // Set while painting when nothing of the view would end up on screen
+    bool isCulled() const { return m_culled; }
+    void setCulled(bool culled) { m_culled = culled; }
+
+    // Cropping and scaling requested through wp_viewport, null when unset.
+    // The source is in surface coordinates before scaling, the destination
+    // replaces the surface size.
+    void setViewport(const QRectF &source, const QSize &destination);
+    // Part of the texture that is drawn, in normalized texture coordinates
+    QRectF textureRect() const;
+
+    // Damage reported by the client since the last frame, in surface-local coordinates.
+    QRegion takeDamage();
+    // Framebuffer rectangle the view covered when it was last painted.
+    QRect paintedRect() const { return m_paintedRect; }
+    void setPaintedRect(const QRect &rect) { m_paintedRect = rect; }
 
 private:
     friend class Compositor;
+    void recycle();
+    QRegion mapToBuffer(const QRegion &region) const;
+    bool isUpscaled() const;
+
     Compositor *m_compositor;
     GLenum m_textureTarget;
     QOpenGLTexture *m_texture;
+    ShmTexture *m_shmTexture;
+    bool m_textureDirty;
+    // Whether a commit since the last texture update attached a buffer
+    bool m_bufferAttached;
+    bool m_bufferOpaque;
+    bool m_culled;
     QOpenGLTextureBlitter::Origin m_origin;
     QPointF m_position;
     QSize m_size;
+    QRectF m_viewportSource;
+    QSize m_viewportDestination;
     QWaylandWlShellSurface *m_wlShellSurface;
     QWaylandXdgSurfaceV5 *m_xdgSurface;
     QWaylandXdgPopupV5 *m_xdgPopup;
     View *m_parentView;
+    View *m_firstChild;
+    View *m_lastChild;
+    View *m_prevSibling;
+    View *m_nextSibling;
     QPoint m_offset;
+    QRegion m_damage;
+    QRegion m_bufferDamage;
+    QRect m_paintedRect;
+    int m_stackingIndex;
+
+    mutable QPointF m_absolutePosition;
+    mutable bool m_absolutePositionDirty;
+    mutable QTransform m_outputTransform;
+    mutable QRectF m_transformGeometry;
+    mutable QSize m_transformViewport;
+    mutable float m_transformAngle;
+    // When frame callbacks were last sent, to throttle hidden surfaces
+    qint64 m_lastFrameCallback;
+    // Whether the client was told that the surface entered the output
+    bool m_enteredOutput;
 
 public slots:
     void onXdgSetMaximized();
@@ -105,6 +186,8 @@ public slots:
     void onXdgSetFullscreen(QWaylandOutput *output);
     void onXdgUnsetFullscreen();
     void onOffsetForNextFrame(const QPoint &offset);
+    void onDamaged(const QRegion &region);
+    void onSizeChanged();
 };
 
 class Compositor : public QWaylandCompositor
@@ -115,11 +198,50 @@ public:
     ~Compositor();
     void create() override;
 
+    // Frames are requested through the frame clock, which calls back
+    // once it is time to render.
+    FrameClock *frameClock() const { return m_frameClock; }
     void startRender();
     void endRender();
+    // To be called once the rendered frame has been swapped
+    void framePresented();
+    // While held, clients get no frame callbacks at all
+    void setFrameCallbacksHeld(bool held);
+    // Surfaces that were hidden and got no frame callbacks with the last frame
+    int throttledSurfaces() const { return m_throttledSurfaces; }
 
-    QList<View*> views() const { return m_views; }
+    // The view showing surface, if any
+    View *findView(const QWaylandSurface *s) const;
+    // All views from bottom to top
+    QList<View*> views() const { ensureStacking(); return m_views; }
+    int viewCount() const { return m_views.count(); }
     void raise(View *view);
+    void setParentView(View *view, View *parent);
+
+    // Topmost view at point, in output coordinates
+    View *viewAt(const QPointF &point) const { ensureStacking(); return m_spatialIndex.viewAt(point); }
+    // To be called when the absolute geometry of view may have changed
+    void viewGeometryChanged(View *view);
+
+    // Output damage in framebuffer coordinates that is not tied to a
+    // surface commit, such as views being restacked or destroyed.
+    void addDamage(const QRegion &region) { m_outputDamage += region; }
+    QRegion takeDamage();
+
+    // The view of the client's cursor surface, if any, and where its
+    // image goes in output coordinates. The image is not part of the
+    // stacking order, but a layer of its own.
+    View *cursorView() const { return m_cursorView; }
+    QRectF cursorGeometry() const;
+    // Pointer position in output coordinates
+    void setCursorPosition(const QPointF &pos);
+
+    // Number of buffers each client has attached that were not released yet
+    QHash<QWaylandClient*, int> buffersHeld() const;
+
+    // Views created from scratch and taken from the pool, for statistics
+    quint64 viewsAllocated() const { return m_viewsAllocated; }
+    quint64 viewsReused() const { return m_viewsReused; }
 
     void handleMouseEvent(QWaylandView *target, QMouseEvent *me);
     void handleTouchEvent(QWaylandView *target, QTouchEvent *e);
@@ -136,6 +258,8 @@ signals:
     void startMove();
     void startResize(int edge, bool anchored);
     void frameOffset(const QPoint &offset);
+    // The view no longer shows a surface and may be reused for another one
+    void viewRemoved(View *view);
 
 public slots:
     void triggerRender();
@@ -143,6 +267,7 @@ public slots:
 private slots:
     void surfaceHasContentChanged();
     void surfaceDestroyed();
+    void onSurfaceCommitted();
     void onStartMove();
     void onWlStartResize(QWaylandSeat *seat, QWaylandWlShellSurface::ResizeEdge edges);
     void onXdgStartResize(QWaylandSeat *seat, QWaylandXdgSurfaceV5::ResizeEdge edges);
@@ -158,17 +283,40 @@ private slots:
     void onSubsurfaceChanged(QWaylandSurface *child, QWaylandSurface *parent);
     void onSubsurfacePositionChanged(const QPoint &position);
 
-    void updateCursor();
-
 private:
-    View *findView(const QWaylandSurface *s) const;
+    void sendFrameCallbacks(bool hiddenOnly);
+    View *createView();
+    void recycleView(View *view);
+    void linkView(View *view, View *parent);
+    void unlinkView(View *view);
+    void addSubtreeDamage(View *view);
+    void ensureStacking() const;
+    void appendSubtree(View *view) const;
     QWindow *m_window;
-    QList<View*> m_views;
+    // Scene tree of views. Top level views are siblings without a parent.
+    View *m_firstView;
+    View *m_lastView;
+    // Flattened stacking order, rebuilt lazily after the tree changed
+    mutable QList<View*> m_views;
+    mutable bool m_stackingDirty;
+    QHash<const QWaylandSurface*, View*> m_viewsBySurface;
+    QVector<View*> m_viewPool;
+    quint64 m_viewsAllocated;
+    quint64 m_viewsReused;
+    QRegion m_outputDamage;
+    SpatialIndex m_spatialIndex;
+    FrameClock *m_frameClock;
+    PresentationTime *m_presentationTime;
+    Viewporter *m_viewporter;
     QWaylandWlShell *m_wlShell;
     QWaylandXdgShellV5 *m_xdgShell;
-    QWaylandView m_cursorView;
-    int m_cursorHotspotX;
-    int m_cursorHotspotY;
+    // View of the cursor surface, drawn on top of everything else
+    View *m_cursorView;
+    QPointF m_cursorHotspot;
+    QPointF m_cursorPosition;
+    int m_throttledSurfaces;
+    bool m_frameCallbacksHeld;
+    QTimer m_keepaliveTimer;
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,58 @@
+#include "controlprotocol.h"
+
+namespace ControlProtocol {
+
+bool decodeJson(const QJsonObject &obj, QVector<ControlCommand> *commands, QString *error)
+{
+    for (auto it = obj.constBegin(); it != obj.constEnd(); ++it) {
+        const QString &key = it.key();
+        ControlCommand command = { ControlCommand::Invalid, 0 };
+
+        if (key == QLatin1String("transform")) {
+            command.type = ControlCommand::SetTransform;
+            command.value = it.value().toString().toInt();
+        } else if (key == QLatin1String("suspended")) {
+            command.type = ControlCommand::SetSuspended;
+            command.value = it.value().toBool();
+        } else if (key == QLatin1String("query")) {
+            if (it.value().toString() != QLatin1String("stats")) {
+                *error = QStringLiteral("Unknown query: ") + it.value().toString();
+                return false;
+            }
+            command.type = ControlCommand::QueryStats;
+            command.value = obj.value(QLatin1String("reset")).toBool();
+        } else if (key == QLatin1String("trace")) {
+            const QString action = it.value().toString();
+            command.type = ControlCommand::Trace;
+            if (action == QLatin1String("stop")) {
+                command.value = ControlCommand::TraceStop;
+            } else if (action == QLatin1String("start")) {
+                command.value = ControlCommand::TraceStart;
+            } else if (action == QLatin1String("dump")) {
+                command.value = ControlCommand::TraceDump;
+            } else {
+                *error = QStringLiteral("Unknown trace action: ") + action;
+                return false;
+            }
+        } else {
+            // Unknown keys are ignored, as they always were
+            continue;
+        }
+
+        commands->append(command);
+    }
+
+    return true;
+}
+
+bool decodeBinary(const ControlMessage &message, ControlCommand *command)
+{
+    if (message.type == ControlCommand::Invalid || message.type >= ControlCommand::TypeCount)
+        return false;
+
+    command->type = ControlCommand::Type(message.type);
+    command->value = message.value;
+    return true;
+}
+
+}
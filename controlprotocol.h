@@ -0,0 +1,61 @@
+#ifndef CONTROLPROTOCOL_H
+#define CONTROLPROTOCOL_H
+
+#include <QtGlobal>
+#include <QJsonObject>
+#include <QVector>
+
+// Commands accepted on the control socket.
+//
+// Clients either send JSON objects terminated by NUL bytes, or, after
+// sending BinaryMagic as their very first byte, fixed-size ControlMessage
+// records. Both are decoded into ControlCommand, so handlers never see
+// which encoding was used. Replies are always NUL-terminated JSON.
+struct ControlCommand
+{
+    enum Type : quint8 {
+        Invalid = 0,
+        // value: rotation in degrees, 90 or 270
+        SetTransform = 1,
+        // value: 1 to suspend, 0 to resume
+        SetSuspended = 2,
+        // value: 1 to reset the statistics after replying
+        QueryStats = 3,
+        // value: one of TraceAction
+        Trace = 4,
+        TypeCount
+    };
+
+    enum TraceAction {
+        TraceStop = 0,
+        TraceStart = 1,
+        // Replies with the recorded events
+        TraceDump = 2
+    };
+
+    Type type;
+    qint32 value;
+};
+
+// On-wire layout of a binary command, in host byte order
+struct ControlMessage
+{
+    quint8 type;
+    quint8 reserved[3];
+    qint32 value;
+};
+
+Q_STATIC_ASSERT(sizeof(ControlMessage) == 8);
+
+namespace ControlProtocol {
+
+const char BinaryMagic = char(0xb1);
+
+// Appends the commands contained in obj. Returns false with error set if
+// a command is malformed.
+bool decodeJson(const QJsonObject &obj, QVector<ControlCommand> *commands, QString *error);
+bool decodeBinary(const ControlMessage &message, ControlCommand *command);
+
+}
+
+#endif // CONTROLPROTOCOL_H
@@ -0,0 +1,446 @@
+#include "evdevinput.h"
+#include "trace.h"
+
+#include <QSocketNotifier>
+#include <QFile>
+#include <QDebug>
+
+#include <linux/input.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+EvdevInput::EvdevInput(const QStringList &devices, QObject *parent)
+    : QThread(parent)
+    , m_paths(devices)
+    , m_wakeFd(-1)
+    , m_stopFd(-1)
+    , m_notifier(nullptr)
+    , m_touchDevice(new QTouchDevice)
+{
+    setObjectName(QStringLiteral("evdev"));
+    m_touchDevice->setName(QStringLiteral("nubbock evdev"));
+    m_touchDevice->setType(QTouchDevice::TouchScreen);
+    m_touchDevice->setCapabilities(QTouchDevice::Position | QTouchDevice::NormalizedPosition);
+}
+
+EvdevInput::~EvdevInput()
+{
+    if (isRunning()) {
+        const quint64 one = 1;
+        if (write(m_stopFd, &one, sizeof(one)) < 0)
+            qWarning() << "Failed to stop evdev input thread";
+        wait();
+    }
+
+    for (const Device &device : qAsConst(m_devices)) {
+        if (device.fd >= 0)
+            close(device.fd);
+    }
+    if (m_wakeFd >= 0)
+        close(m_wakeFd);
+    if (m_stopFd >= 0)
+        close(m_stopFd);
+
+    delete m_touchDevice;
+}
+
+bool EvdevInput::start()
+{
+    for (const QString &path : qAsConst(m_paths))
+        openDevice(path);
+
+    if (m_devices.isEmpty())
+        return false;
+
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeFd < 0 || m_stopFd < 0) {
+        qWarning() << "Failed to create eventfd for evdev input:" << strerror(errno);
+        return false;
+    }
+
+    m_notifier = new QSocketNotifier(m_wakeFd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &EvdevInput::drain);
+
+    QThread::start(QThread::HighestPriority);
+    return true;
+}
+
+// Devices that can't tell their axis ranges, like recordings, report
+// window pixels.
+void EvdevInput::openDevice(const QString &path)
+{
+    const int fd = open(QFile::encodeName(path).constData(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        qWarning() << "Failed to open" << path << ":" << strerror(errno);
+        return;
+    }
+
+    Device device;
+    device.fd = fd;
+    device.index = m_devices.count();
+    device.minX = 0;
+    device.maxX = qMax(1, m_targetSize.width());
+    device.minY = 0;
+    device.maxY = qMax(1, m_targetSize.height());
+    device.multiTouch = false;
+    device.dropped = false;
+    device.currentSlot = 0;
+    memset(device.slots, 0, sizeof(device.slots));
+
+    struct input_absinfo absX, absY;
+    if (ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X), &absX) >= 0 && ioctl(fd, EVIOCGABS(ABS_MT_POSITION_Y), &absY) >= 0
+            && absX.maximum > absX.minimum && absY.maximum > absY.minimum) {
+        device.minX = absX.minimum;
+        device.maxX = absX.maximum;
+        device.minY = absY.minimum;
+        device.maxY = absY.maximum;
+    } else if (ioctl(fd, EVIOCGABS(ABS_X), &absX) >= 0 && ioctl(fd, EVIOCGABS(ABS_Y), &absY) >= 0
+            && absX.maximum > absX.minimum && absY.maximum > absY.minimum) {
+        device.minX = absX.minimum;
+        device.maxX = absX.maximum;
+        device.minY = absY.minimum;
+        device.maxY = absY.maximum;
+    }
+
+    qInfo() << "Reading touch input from" << path;
+    m_devices.append(device);
+}
+
+void EvdevInput::run()
+{
+    QVector<pollfd> fds(m_devices.count() + 1);
+
+    for (;;) {
+        int n = 0;
+        fds[n].fd = m_stopFd;
+        fds[n].events = POLLIN;
+        n++;
+        for (const Device &device : qAsConst(m_devices)) {
+            fds[n].fd = device.fd;
+            fds[n].events = POLLIN;
+            n++;
+        }
+
+        if (poll(fds.data(), n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            qWarning() << "Polling evdev devices failed:" << strerror(errno);
+            return;
+        }
+
+        if (fds[0].revents)
+            return;
+
+        bool pushed = false;
+        for (int i = 0; i < m_devices.count(); i++) {
+            if (fds[i + 1].revents && m_devices[i].fd >= 0)
+                pushed |= readDevice(m_devices[i]);
+        }
+
+        // One wakeup for everything read in this round
+        if (pushed)
+            wake();
+    }
+}
+
+// Reads up to ReadBatch events at once. Returns true if a frame was queued.
+bool EvdevInput::readDevice(Device &device)
+{
+    char buffer[ReadBatch * sizeof(struct input_event)];
+    const int carried = device.remainder.size();
+    memcpy(buffer, device.remainder.constData(), carried);
+
+    const ssize_t count = read(device.fd, buffer + carried, sizeof(buffer) - carried);
+    if (count < 0 && (errno == EAGAIN || errno == EINTR))
+        return false;
+
+    // End of a recording, or the device went away
+    if (count <= 0) {
+        close(device.fd);
+        device.fd = -1;
+        return false;
+    }
+
+    const int total = carried + int(count);
+    const int events = total / int(sizeof(struct input_event));
+    device.remainder = QByteArray(buffer + events * sizeof(struct input_event),
+                                  total - events * int(sizeof(struct input_event)));
+
+    bool pushed = false;
+    for (int i = 0; i < events; i++) {
+        struct input_event event;
+        memcpy(&event, buffer + i * sizeof(struct input_event), sizeof(event));
+        const quint64 timestamp = quint64(event.time.tv_sec) * 1000 + event.time.tv_usec / 1000;
+        if (event.type == EV_SYN && event.code == SYN_REPORT)
+            pushed = true;
+        handleEvent(device, event.type, event.code, event.value, timestamp);
+    }
+
+    return pushed;
+}
+
+void EvdevInput::handleEvent(Device &device, quint16 type, quint16 code, qint32 value, quint64 timestamp)
+{
+    // After the kernel dropped events, whatever arrives up to the next
+    // report is incomplete, and the state is read back from the device
+    // instead
+    if (type == EV_SYN) {
+        if (code == SYN_DROPPED) {
+            device.dropped = true;
+        } else if (code == SYN_REPORT) {
+            if (device.dropped)
+                resync(device, timestamp);
+            pushFrame(device, timestamp);
+            device.dropped = false;
+        }
+        return;
+    }
+
+    if (device.dropped)
+        return;
+
+    Slot &slot = device.slots[device.currentSlot];
+
+    if (type == EV_ABS) {
+        switch (code) {
+        case ABS_MT_SLOT:
+            device.multiTouch = true;
+            if (value >= 0 && value < MaxSlots)
+                device.currentSlot = value;
+            break;
+        case ABS_MT_TRACKING_ID:
+            device.multiTouch = true;
+            slot.down = value >= 0;
+            if (slot.down)
+                slot.id = (device.index << 16) | (value & 0xffff);
+            slot.changed = true;
+            break;
+        case ABS_MT_POSITION_X:
+            device.multiTouch = true;
+            slot.x = value;
+            slot.changed = true;
+            break;
+        case ABS_MT_POSITION_Y:
+            device.multiTouch = true;
+            slot.y = value;
+            slot.changed = true;
+            break;
+        case ABS_X:
+            if (!device.multiTouch) {
+                device.slots[0].x = value;
+                device.slots[0].changed = true;
+            }
+            break;
+        case ABS_Y:
+            if (!device.multiTouch) {
+                device.slots[0].y = value;
+                device.slots[0].changed = true;
+            }
+            break;
+        default:
+            break;
+        }
+    } else if (type == EV_KEY && code == BTN_TOUCH && !device.multiTouch) {
+        device.slots[0].down = value != 0;
+        device.slots[0].id = device.index << 16;
+        device.slots[0].changed = true;
+    }
+}
+
+// Devices that can't be asked, like FIFOs and recordings, get all their
+// points released, so that none stays down for good.
+void EvdevInput::resync(Device &device, quint64 timestamp)
+{
+    const bool synced = device.multiTouch ? resyncMultiTouch(device, timestamp) : resyncSingleTouch(device);
+    if (synced)
+        return;
+
+    qWarning() << "Lost touch events, releasing all points of device" << device.index;
+    for (Slot &slot : device.slots) {
+        if (slot.wasDown) {
+            slot.down = false;
+            slot.changed = true;
+        }
+    }
+}
+
+bool EvdevInput::resyncMultiTouch(Device &device, quint64 timestamp)
+{
+    struct {
+        quint32 code;
+        qint32 values[MaxSlots];
+    } ids, xs, ys;
+    ids.code = ABS_MT_TRACKING_ID;
+    xs.code = ABS_MT_POSITION_X;
+    ys.code = ABS_MT_POSITION_Y;
+
+    struct input_absinfo slotInfo;
+    if (ioctl(device.fd, EVIOCGMTSLOTS(sizeof(ids)), &ids) < 0
+            || ioctl(device.fd, EVIOCGMTSLOTS(sizeof(xs)), &xs) < 0
+            || ioctl(device.fd, EVIOCGMTSLOTS(sizeof(ys)), &ys) < 0
+            || ioctl(device.fd, EVIOCGABS(ABS_MT_SLOT), &slotInfo) < 0)
+        return false;
+
+    if (slotInfo.value >= 0 && slotInfo.value < MaxSlots)
+        device.currentSlot = slotInfo.value;
+
+    for (int i = 0; i < MaxSlots; i++) {
+        Slot &slot = device.slots[i];
+        const bool down = ids.values[i] >= 0;
+        const qint32 id = (device.index << 16) | (ids.values[i] & 0xffff);
+
+        // The point that was down was lifted and another one went down in
+        // the same slot, both unseen. The old one is released first.
+        if (down && slot.wasDown && slot.id != id) {
+            Record record;
+            record.type = Record::Up;
+            record.id = slot.id;
+            record.x = (slot.x - device.minX) / (device.maxX - device.minX);
+            record.y = (slot.y - device.minY) / (device.maxY - device.minY);
+            record.timestamp = timestamp;
+            push(record);
+            slot.wasDown = false;
+        }
+
+        if (down) {
+            slot.id = id;
+            slot.x = xs.values[i];
+            slot.y = ys.values[i];
+        }
+        slot.down = down;
+        slot.changed = down || slot.wasDown;
+    }
+
+    return true;
+}
+
+bool EvdevInput::resyncSingleTouch(Device &device)
+{
+    quint8 keys[KEY_MAX / 8 + 1];
+    struct input_absinfo absX, absY;
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(device.fd, EVIOCGKEY(sizeof(keys)), keys) < 0
+            || ioctl(device.fd, EVIOCGABS(ABS_X), &absX) < 0 || ioctl(device.fd, EVIOCGABS(ABS_Y), &absY) < 0)
+        return false;
+
+    Slot &slot = device.slots[0];
+    slot.down = keys[BTN_TOUCH / 8] & (1 << (BTN_TOUCH % 8));
+    slot.id = device.index << 16;
+    slot.x = absX.value;
+    slot.y = absY.value;
+    slot.changed = slot.down || slot.wasDown;
+    return true;
+}
+
+void EvdevInput::pushFrame(Device &device, quint64 timestamp)
+{
+    bool changed = false;
+
+    for (Slot &slot : device.slots) {
+        if (!slot.changed)
+            continue;
+        slot.changed = false;
+
+        Record record;
+        if (slot.down)
+            record.type = slot.wasDown ? Record::Motion : Record::Down;
+        else if (slot.wasDown)
+            record.type = Record::Up;
+        else
+            continue;
+
+        record.id = slot.id;
+        record.x = (slot.x - device.minX) / (device.maxX - device.minX);
+        record.y = (slot.y - device.minY) / (device.maxY - device.minY);
+        record.timestamp = timestamp;
+        push(record);
+
+        slot.wasDown = slot.down;
+        changed = true;
+    }
+
+    if (changed) {
+        TRACE_INSTANT(Input, "evdevFrame", device.index);
+        Record frame = { Record::Frame, 0, 0, 0, timestamp };
+        push(frame);
+    }
+}
+
+// A full queue means the GUI thread is stalled; events then back up in
+// the kernel instead of being dropped.
+void EvdevInput::push(const Record &record)
+{
+    while (!m_queue.push(record)) {
+        wake();
+        usleep(1000);
+    }
+}
+
+void EvdevInput::wake()
+{
+    const quint64 one = 1;
+    if (write(m_wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        qWarning() << "Failed to wake up GUI thread:" << strerror(errno);
+}
+
+// Runs on the GUI thread. Every frame of records becomes one touch event
+// carrying all points currently down.
+void EvdevInput::drain()
+{
+    quint64 count;
+    if (read(m_wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        qWarning() << "Failed to reset evdev wakeup:" << strerror(errno);
+
+    Record record;
+    while (m_queue.pop(&record)) {
+        if (record.type != Record::Frame) {
+            const QPointF normalized(record.x, record.y);
+            const QPointF pos(record.x * m_targetSize.width(), record.y * m_targetSize.height());
+
+            QTouchEvent::TouchPoint &point = m_points[record.id];
+            if (record.type == Record::Down) {
+                point = QTouchEvent::TouchPoint(record.id);
+                point.setState(Qt::TouchPointPressed);
+                point.setStartPos(pos);
+                point.setStartNormalizedPos(normalized);
+            } else {
+                point.setState(record.type == Record::Up ? Qt::TouchPointReleased : Qt::TouchPointMoved);
+                point.setLastPos(point.pos());
+                point.setLastNormalizedPos(point.normalizedPos());
+            }
+            point.setPos(pos);
+            point.setScreenPos(pos);
+            point.setNormalizedPos(normalized);
+            continue;
+        }
+
+        Qt::TouchPointStates states = 0;
+        for (const QTouchEvent::TouchPoint &point : qAsConst(m_points))
+            states |= point.state();
+
+        QEvent::Type type = QEvent::TouchUpdate;
+        if (states == Qt::TouchPointPressed)
+            type = QEvent::TouchBegin;
+        else if (states == Qt::TouchPointReleased)
+            type = QEvent::TouchEnd;
+
+        QTouchEvent event(type, m_touchDevice, Qt::NoModifier, states, m_points.values());
+        event.setTimestamp(ulong(record.timestamp));
+        emit touchEvent(&event);
+
+        for (auto it = m_points.begin(); it != m_points.end(); ) {
+            if (it->state() == Qt::TouchPointReleased) {
+                it = m_points.erase(it);
+            } else {
+                it->setState(Qt::TouchPointStationary);
+                ++it;
+            }
+        }
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef EVDEVINPUT_H
+#define EVDEVINPUT_H
+
+#include <QThread>
+#include <QStringList>
+#include <QSize>
+#include <QHash>
+#include <QVector>
+#include <QByteArray>
+#include <QTouchEvent>
+#include "spscqueue.h"
+
+class QSocketNotifier;
+
+// Reads touch input from evdev devices on a thread of its own.
+//
+// The thread decodes multi-touch (protocol B) and single-touch events and
+// passes per-point records through a lock-free queue. An eventfd wakes the
+// GUI thread, which turns each completed frame into a QTouchEvent. Devices
+// may also be FIFOs or files holding recorded struct input_event streams,
+// which are replayed as fast as they can be read.
+class EvdevInput : public QThread
+{
+    Q_OBJECT
+public:
+    explicit EvdevInput(const QStringList &devices, QObject *parent = nullptr);
+    ~EvdevInput();
+
+    // Size of the window touch positions are mapped to. Devices that don't
+    // report their axis ranges are taken to report window pixels.
+    void setTargetSize(const QSize &size) { m_targetSize = size; }
+
+    bool start();
+
+signals:
+    void touchEvent(QTouchEvent *event);
+
+protected:
+    void run() override;
+
+private:
+    struct Record {
+        enum Type : quint8 {
+            Down,
+            Motion,
+            Up,
+            Frame
+        };
+
+        Type type;
+        qint32 id;
+        float x;
+        float y;
+        quint64 timestamp;
+    };
+
+    enum { MaxSlots = 16, ReadBatch = 64 };
+
+    struct Slot {
+        qint32 id;
+        float x;
+        float y;
+        bool down;
+        bool wasDown;
+        bool changed;
+    };
+
+    struct Device {
+        int fd;
+        int index;
+        float minX, maxX;
+        float minY, maxY;
+        bool multiTouch;
+        bool dropped;
+        int currentSlot;
+        Slot slots[MaxSlots];
+        // Partial struct input_event left over from the last read
+        QByteArray remainder;
+    };
+
+    void openDevice(const QString &path);
+    bool readDevice(Device &device);
+    void handleEvent(Device &device, quint16 type, quint16 code, qint32 value, quint64 timestamp);
+    void resync(Device &device, quint64 timestamp);
+    bool resyncMultiTouch(Device &device, quint64 timestamp);
+    bool resyncSingleTouch(Device &device);
+    void pushFrame(Device &device, quint64 timestamp);
+    void push(const Record &record);
+    void wake();
+    void drain();
+
+    QStringList m_paths;
+    QVector<Device> m_devices;
+    QSize m_targetSize;
+
+    int m_wakeFd;
+    int m_stopFd;
+    QSocketNotifier *m_notifier;
+    SpscQueue<Record, 1024> m_queue;
+    QTouchDevice *m_touchDevice;
+
+    // GUI thread state of the touch points currently down
+    QHash<qint32, QTouchEvent::TouchPoint> m_points;
+};
+
+#endif // EVDEVINPUT_H
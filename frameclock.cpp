@@ -0,0 +1,170 @@
+#include "frameclock.h"
+
+#include <QtMath>
+#include <time.h>
+
+// Number of frames the render time prediction looks back on
+static const int renderTimeHistory = 16;
+// Slack left between the predicted end of rendering and the vblank
+static const qint64 renderMargin = 1000000;
+
+FrameClock::FrameClock(QObject *parent)
+    : QObject(parent)
+    , m_interval(1000000000 / 60)
+    , m_scheduled(false)
+    , m_inFlight(false)
+    , m_pendingRequest(false)
+    , m_frameRequested(false)
+    , m_requestTime(0)
+    , m_targetVblank(0)
+    , m_lastPresentation(0)
+    , m_lastRenderTime(0)
+    , m_lastCommitLatency(0)
+    , m_missedFrames(0)
+    , m_pendingCommit(0)
+    , m_frameCommit(0)
+    , m_renderTimeIndex(0)
+{
+    m_timer.setSingleShot(true);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, &QTimer::timeout, this, &FrameClock::onTimeout);
+}
+
+qint64 FrameClock::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void FrameClock::setRefreshRate(qreal hz)
+{
+    if (hz <= 0)
+        hz = 60;
+    m_interval = qRound64(1000000000 / hz);
+}
+
+// Without a presentation to align to, any time is as good as another.
+qint64 FrameClock::nextVblank(qint64 after) const
+{
+    if (!m_lastPresentation)
+        return after;
+    if (after <= m_lastPresentation)
+        return m_lastPresentation + m_interval;
+
+    const qint64 intervals = (after - m_lastPresentation + m_interval - 1) / m_interval;
+    return m_lastPresentation + intervals * m_interval;
+}
+
+qint64 FrameClock::predictedRenderTime() const
+{
+    if (m_renderTimes.isEmpty())
+        return m_interval / 2;
+
+    qint64 longest = 0;
+    for (qint64 time : m_renderTimes)
+        longest = qMax(longest, time);
+    return longest + renderMargin;
+}
+
+void FrameClock::scheduleFrame()
+{
+    m_frameRequested = true;
+    scheduleWakeup();
+}
+
+void FrameClock::scheduleWakeup()
+{
+    if (m_scheduled)
+        return;
+
+    // Frames are not queued up behind each other, the next one is
+    // scheduled once the one in flight has been presented.
+    if (m_inFlight) {
+        m_pendingRequest = true;
+        return;
+    }
+
+    // A wakeup that ends up not rendering leaves no target behind,
+    // renderStarted() picks one if a frame is asked for late
+    const qint64 t = now();
+    const qint64 predicted = predictedRenderTime();
+    const qint64 target = nextVblank(t + predicted);
+    if (m_frameRequested)
+        m_targetVblank = target;
+
+    const qint64 delay = qMax<qint64>(0, target - predicted - t);
+    m_scheduled = true;
+    m_timer.start(int(delay / 1000000));
+}
+
+void FrameClock::onTimeout()
+{
+    m_scheduled = false;
+    if (m_frameRequested)
+        m_requestTime = now();
+    emit renderRequested();
+}
+
+void FrameClock::commitReceived()
+{
+    if (!m_pendingCommit)
+        m_pendingCommit = now();
+}
+
+void FrameClock::renderStarted()
+{
+    const qint64 t = now();
+
+    // Something painted without waiting for the clock, which is as good
+    // as the scheduled frame.
+    if (m_scheduled) {
+        m_timer.stop();
+        m_scheduled = false;
+    }
+    if (!m_targetVblank)
+        m_targetVblank = nextVblank(t);
+    if (!m_requestTime)
+        m_requestTime = t;
+
+    m_inFlight = true;
+    m_frameRequested = false;
+    if (!m_frameCommit)
+        m_frameCommit = m_pendingCommit;
+    m_pendingCommit = 0;
+}
+
+void FrameClock::renderFinished()
+{
+    m_lastRenderTime = now() - m_requestTime;
+    m_requestTime = 0;
+
+    if (m_renderTimes.count() < renderTimeHistory) {
+        m_renderTimes.append(m_lastRenderTime);
+    } else {
+        m_renderTimes[m_renderTimeIndex] = m_lastRenderTime;
+        m_renderTimeIndex = (m_renderTimeIndex + 1) % renderTimeHistory;
+    }
+}
+
+// The swap blocks until the vblank, so the time it returns at is taken as
+// the presentation time.
+void FrameClock::framePresented()
+{
+    const qint64 t = now();
+
+    if (m_targetVblank && t > m_targetVblank + m_interval / 2)
+        m_missedFrames++;
+
+    m_lastCommitLatency = m_frameCommit ? t - m_frameCommit : 0;
+    m_frameCommit = 0;
+
+    m_lastPresentation = t;
+    m_targetVblank = 0;
+    m_inFlight = false;
+
+    if (m_pendingRequest) {
+        m_pendingRequest = false;
+        scheduleWakeup();
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef FRAMECLOCK_H
+#define FRAMECLOCK_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+// Decides when in the refresh cycle a frame is composited.
+//
+// The clock follows the presentation timestamps of the output and keeps a
+// history of how long recent frames took from being requested to being
+// ready for the swap. A requested frame is started as late as that
+// prediction allows while still making the next vblank, so that commits
+// arriving in the meantime are picked up by the same frame.
+//
+// All timestamps are CLOCK_MONOTONIC nanoseconds.
+class FrameClock : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FrameClock(QObject *parent = nullptr);
+
+    static qint64 now();
+
+    void setRefreshRate(qreal hz);
+    qint64 refreshInterval() const { return m_interval; }
+
+    // Asks for a frame to be presented at the next possible vblank
+    void scheduleFrame();
+    // Wakes up when the next frame would be started, without asking for
+    // one, so that coalesced input goes out in step with frames
+    void scheduleWakeup();
+    // Whether a frame was asked for since the last one was started
+    bool isFrameRequested() const { return m_frameRequested; }
+
+    // To be called when a client commits new state
+    void commitReceived();
+    // Forgets commits waiting for a frame, after a time without frames
+    // whose latency would mean nothing
+    void discardCommits() { m_pendingCommit = 0; }
+
+    // To be called around painting, and once the frame has been swapped
+    void renderStarted();
+    void renderFinished();
+    void framePresented();
+
+    qint64 predictedRenderTime() const;
+    qint64 lastPresentationTime() const { return m_lastPresentation; }
+    qint64 lastRenderTime() const { return m_lastRenderTime; }
+    // Longest time a commit shown by the last frame waited to get on screen
+    qint64 lastCommitLatency() const { return m_lastCommitLatency; }
+    int missedFrames() const { return m_missedFrames; }
+
+signals:
+    void renderRequested();
+
+private slots:
+    void onTimeout();
+
+private:
+    qint64 nextVblank(qint64 after) const;
+
+    QTimer m_timer;
+    qint64 m_interval;
+
+    bool m_scheduled;
+    bool m_inFlight;
+    bool m_pendingRequest;
+    bool m_frameRequested;
+
+    qint64 m_requestTime;
+    qint64 m_targetVblank;
+    qint64 m_lastPresentation;
+    qint64 m_lastRenderTime;
+    qint64 m_lastCommitLatency;
+    int m_missedFrames;
+
+    // Oldest commit waiting for the next frame, and the oldest one the
+    // frame being rendered picked up, 0 for none. Only the oldest one
+    // decides the latency.
+    qint64 m_pendingCommit;
+    qint64 m_frameCommit;
+
+    QVector<qint64> m_renderTimes;
+    int m_renderTimeIndex;
+};
+
+#endif // FRAMECLOCK_H
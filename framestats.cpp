@@ -0,0 +1,224 @@
+#include "framestats.h"
+
+#include <QOpenGLContext>
+#include <QJsonArray>
+#include <QtMath>
+#include <cstring>
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+// Bucket upper bounds in ns, finer around the frame budget of 16.7 ms
+const qint64 Histogram::bucketBounds[Histogram::BucketCount] = {
+    50000, 100000, 200000, 300000, 500000, 750000,
+    1000000, 1500000, 2000000, 3000000, 4000000, 5000000,
+    6000000, 8000000, 10000000, 12000000, 14000000, 16000000,
+    17000000, 20000000, 25000000, 33000000, 50000000, 100000000
+};
+
+Histogram::Histogram()
+{
+    reset();
+}
+
+void Histogram::reset()
+{
+    memset(m_buckets, 0, sizeof(m_buckets));
+    m_count = 0;
+    m_sum = 0;
+    m_max = 0;
+}
+
+void Histogram::record(qint64 ns)
+{
+    int bucket = 0;
+    while (bucket < BucketCount && ns > bucketBounds[bucket])
+        bucket++;
+
+    m_buckets[bucket]++;
+    m_count++;
+    m_sum += ns;
+    m_max = qMax(m_max, ns);
+}
+
+qint64 Histogram::percentile(qreal fraction) const
+{
+    if (!m_count)
+        return 0;
+
+    const quint64 rank = qMax<quint64>(1, quint64(qCeil(fraction * m_count)));
+    quint64 seen = 0;
+    for (int i = 0; i < BucketCount; i++) {
+        seen += m_buckets[i];
+        if (seen >= rank)
+            return qMin(bucketBounds[i], m_max);
+    }
+
+    return m_max;
+}
+
+// Durations are reported in microseconds
+QJsonObject Histogram::toJson() const
+{
+    QJsonArray buckets;
+    for (int i = 0; i <= BucketCount; i++) {
+        QJsonObject bucket;
+        if (i < BucketCount)
+            bucket["le"] = double(bucketBounds[i] / 1000);
+        else
+            bucket["le"] = QStringLiteral("inf");
+        bucket["count"] = double(m_buckets[i]);
+        buckets.append(bucket);
+    }
+
+    QJsonObject obj;
+    obj["count"] = double(m_count);
+    obj["mean"] = m_count ? double(m_sum / qint64(m_count) / 1000) : 0.0;
+    obj["max"] = double(m_max / 1000);
+    obj["p50"] = double(percentile(0.5) / 1000);
+    obj["p90"] = double(percentile(0.9) / 1000);
+    obj["p99"] = double(percentile(0.99) / 1000);
+    obj["buckets"] = buckets;
+    return obj;
+}
+
+GpuTimer::GpuTimer()
+    : m_genQueries(nullptr)
+    , m_deleteQueries(nullptr)
+    , m_beginQuery(nullptr)
+    , m_endQuery(nullptr)
+    , m_getQueryObjectuiv(nullptr)
+    , m_getQueryObjectui64v(nullptr)
+    , m_supported(false)
+    , m_disjointCheck(false)
+    , m_active(false)
+    , m_first(0)
+    , m_pending(0)
+{
+}
+
+bool GpuTimer::create(QOpenGLContext *context)
+{
+    initializeOpenGLFunctions();
+
+    QByteArray suffix;
+    if (context->isOpenGLES()) {
+        if (!context->hasExtension(QByteArrayLiteral("GL_EXT_disjoint_timer_query")))
+            return false;
+        suffix = QByteArrayLiteral("EXT");
+        m_disjointCheck = true;
+    } else {
+        const QSurfaceFormat format = context->format();
+        if (qMakePair(format.majorVersion(), format.minorVersion()) < qMakePair(3, 3)
+                && !context->hasExtension(QByteArrayLiteral("GL_ARB_timer_query")))
+            return false;
+    }
+
+    m_genQueries = reinterpret_cast<GenQueries>(context->getProcAddress("glGenQueries" + suffix));
+    m_deleteQueries = reinterpret_cast<DeleteQueries>(context->getProcAddress("glDeleteQueries" + suffix));
+    m_beginQuery = reinterpret_cast<BeginQuery>(context->getProcAddress("glBeginQuery" + suffix));
+    m_endQuery = reinterpret_cast<EndQuery>(context->getProcAddress("glEndQuery" + suffix));
+    m_getQueryObjectuiv = reinterpret_cast<GetQueryObjectuiv>(context->getProcAddress("glGetQueryObjectuiv" + suffix));
+    m_getQueryObjectui64v = reinterpret_cast<GetQueryObjectui64v>(context->getProcAddress("glGetQueryObjectui64v" + suffix));
+
+    if (!m_genQueries || !m_deleteQueries || !m_beginQuery || !m_endQuery
+            || !m_getQueryObjectuiv || !m_getQueryObjectui64v)
+        return false;
+
+    m_genQueries(QueryCount, m_queries);
+    m_supported = true;
+    return true;
+}
+
+void GpuTimer::destroy()
+{
+    if (!m_supported)
+        return;
+
+    if (m_active)
+        m_endQuery(GL_TIME_ELAPSED);
+    m_deleteQueries(QueryCount, m_queries);
+    m_supported = false;
+    m_active = false;
+    m_pending = 0;
+}
+
+// When all queries are still waiting for results, the frame goes unmeasured.
+void GpuTimer::begin()
+{
+    if (!m_supported || m_active || m_pending == QueryCount)
+        return;
+
+    m_beginQuery(GL_TIME_ELAPSED, m_queries[(m_first + m_pending) % QueryCount]);
+    m_active = true;
+}
+
+void GpuTimer::end()
+{
+    if (!m_active)
+        return;
+
+    m_endQuery(GL_TIME_ELAPSED);
+    m_active = false;
+    m_pending++;
+}
+
+bool GpuTimer::takeResult(qint64 *ns)
+{
+    if (!m_pending)
+        return false;
+
+    // Results spanning a disjoint event, like a GPU frequency change,
+    // are meaningless
+    if (m_disjointCheck) {
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        if (disjoint) {
+            m_first = (m_first + m_pending) % QueryCount;
+            m_pending = 0;
+            return false;
+        }
+    }
+
+    const GLuint query = m_queries[m_first];
+    GLuint available = 0;
+    m_getQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return false;
+
+    quint64 elapsed = 0;
+    m_getQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+    m_first = (m_first + 1) % QueryCount;
+    m_pending--;
+
+    *ns = qint64(elapsed);
+    return true;
+}
+
+void FrameStats::reset()
+{
+    for (Histogram &histogram : m_histograms)
+        histogram.reset();
+}
+
+QJsonObject FrameStats::toJson() const
+{
+    static const char *const names[MetricCount] = {
+        "frame", "upload", "render", "gpu", "latency", "dispatch"
+    };
+
+    QJsonObject obj;
+    for (int i = 0; i < MetricCount; i++)
+        obj[QLatin1String(names[i])] = m_histograms[i].toJson();
+    return obj;
+}
@@ -0,0 +1,103 @@
+#ifndef FRAMESTATS_H
+#define FRAMESTATS_H
+
+#include <QOpenGLFunctions>
+#include <QJsonObject>
+
+class QOpenGLContext;
+
+// Fixed-bucket histogram of durations. Recording is a bucket lookup and a
+// few increments, so it can stay enabled all the time.
+class Histogram
+{
+public:
+    Histogram();
+
+    void record(qint64 ns);
+    void reset();
+
+    quint64 count() const { return m_count; }
+    // Upper bound of the bucket the given fraction of samples falls into, in ns
+    qint64 percentile(qreal fraction) const;
+
+    QJsonObject toJson() const;
+
+private:
+    enum { BucketCount = 24 };
+    static const qint64 bucketBounds[BucketCount];
+
+    // One more bucket for everything above the last bound
+    quint64 m_buckets[BucketCount + 1];
+    quint64 m_count;
+    qint64 m_sum;
+    qint64 m_max;
+};
+
+// Measures how long the GPU spends on a frame with timer queries, from
+// EXT_disjoint_timer_query on OpenGL ES and ARB_timer_query otherwise.
+// Results are read back frames later without stalling the pipeline.
+class GpuTimer : protected QOpenGLFunctions
+{
+public:
+    GpuTimer();
+
+    // Must be called with the context current. Returns false if the
+    // context has no timer queries, in which case the timer does nothing.
+    bool create(QOpenGLContext *context);
+    void destroy();
+
+    void begin();
+    void end();
+    // Takes the oldest finished measurement, if there is one
+    bool takeResult(qint64 *ns);
+
+private:
+    enum { QueryCount = 4 };
+
+    typedef void (QOPENGLF_APIENTRYP GenQueries)(GLsizei n, GLuint *ids);
+    typedef void (QOPENGLF_APIENTRYP DeleteQueries)(GLsizei n, const GLuint *ids);
+    typedef void (QOPENGLF_APIENTRYP BeginQuery)(GLenum target, GLuint id);
+    typedef void (QOPENGLF_APIENTRYP EndQuery)(GLenum target);
+    typedef void (QOPENGLF_APIENTRYP GetQueryObjectuiv)(GLuint id, GLenum pname, GLuint *params);
+    typedef void (QOPENGLF_APIENTRYP GetQueryObjectui64v)(GLuint id, GLenum pname, quint64 *params);
+
+    GenQueries m_genQueries;
+    DeleteQueries m_deleteQueries;
+    BeginQuery m_beginQuery;
+    EndQuery m_endQuery;
+    GetQueryObjectuiv m_getQueryObjectuiv;
+    GetQueryObjectui64v m_getQueryObjectui64v;
+
+    bool m_supported;
+    bool m_disjointCheck;
+    bool m_active;
+    GLuint m_queries[QueryCount];
+    // Queries are used round robin, pending ones are [m_first, m_first + m_pending)
+    int m_first;
+    int m_pending;
+};
+
+// Timing histograms of the stages of a frame
+class FrameStats
+{
+public:
+    enum Metric {
+        FrameTime,
+        UploadTime,
+        RenderTime,
+        GpuTime,
+        CommitLatency,
+        DispatchTime,
+        MetricCount
+    };
+
+    void record(Metric metric, qint64 ns) { m_histograms[metric].record(ns); }
+    void reset();
+
+    QJsonObject toJson() const;
+
+private:
+    Histogram m_histograms[MetricCount];
+};
+
+#endif // FRAMESTATS_H
@@ -52,11 +52,15 @@
 
 #include "window.h"
 #include "compositor.h"
+#include "trace.h"
 
 int main(int argc, char *argv[])
 {
     QGuiApplication app(argc, argv);
 
+    if (qEnvironmentVariableIsSet("NUBBOCK_TRACE"))
+        Trace::setEnabled(true);
+
     Window window(QWaylandOutput::Transform90);
     Compositor compositor(&window);
     window.setCompositor(&compositor);
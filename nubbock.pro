@@ -1,13 +1,41 @@
 QT += gui gui-private core-private waylandcompositor waylandcompositor-private
 
-LIBS += -L ../../lib
+LIBS += -L ../../lib -lEGL
+
+CONFIG += link_pkgconfig wayland-scanner
+PKGCONFIG += wayland-server
+
+WAYLANDSERVERSOURCES += \
+    protocol/presentation-time.xml \
+    protocol/viewporter.xml
 
 HEADERS += \
     compositor.h \
     window.h \
-    socketserver.h
+    socketserver.h \
+    quadrenderer.h \
+    textureuploader.h \
+    frameclock.h \
+    framestats.h \
+    controlprotocol.h \
+    spatialindex.h \
+    spscqueue.h \
+    evdevinput.h \
+    trace.h \
+    presentationtime.h \
+    viewporter.h
 
 SOURCES += main.cpp \
     compositor.cpp \
     window.cpp \
-    socketserver.cpp
+    socketserver.cpp \
+    quadrenderer.cpp \
+    textureuploader.cpp \
+    frameclock.cpp \
+    framestats.cpp \
+    controlprotocol.cpp \
+    spatialindex.cpp \
+    evdevinput.cpp \
+    trace.cpp \
+    presentationtime.cpp \
+    viewporter.cpp
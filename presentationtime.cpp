@@ -0,0 +1,156 @@
+#include "presentationtime.h"
+#include "compositor.h"
+
+#include <QtWaylandCompositor/QWaylandSurface>
+#include <QtWaylandCompositor/QWaylandOutput>
+#include <QtWaylandCompositor/private/qwaylandoutput_p.h>
+#include "wayland-presentation-time-server-protocol.h"
+
+#include <time.h>
+
+PresentationTime::PresentationTime(Compositor *compositor)
+    : QObject(compositor)
+    , QtWaylandServer::wp_presentation(compositor->display(), 1)
+    , m_compositor(compositor)
+{
+}
+
+PresentationTime::~PresentationTime()
+{
+    for (auto it = m_surfaces.begin(); it != m_surfaces.end(); ++it) {
+        discard(&it->pending);
+        discard(&it->committed);
+    }
+    discard(&m_latched);
+}
+
+void PresentationTime::wp_presentation_bind_resource(Resource *resource)
+{
+    send_clock_id(resource->handle, CLOCK_MONOTONIC);
+}
+
+void PresentationTime::wp_presentation_destroy(Resource *resource)
+{
+    wl_resource_destroy(resource->handle);
+}
+
+void PresentationTime::wp_presentation_feedback(Resource *resource, struct ::wl_resource *surfaceResource, uint32_t callback)
+{
+    QWaylandSurface *surface = QWaylandSurface::fromResource(surfaceResource);
+    struct ::wl_resource *feedback = wl_resource_create(resource->client(), &wp_presentation_feedback_interface,
+                                                        wl_resource_get_version(resource->handle), callback);
+    if (!feedback) {
+        wl_client_post_no_memory(resource->client());
+        return;
+    }
+    wl_resource_set_implementation(feedback, nullptr, this, destroyFeedback);
+
+    if (!m_surfaces.contains(surface)) {
+        connect(surface, &QWaylandSurface::redraw, this, [this, surface]() {
+            surfaceCommitted(surface);
+        });
+        connect(surface, &QWaylandSurface::surfaceDestroyed, this, [this, surface]() {
+            surfaceDestroyed(surface);
+        });
+    }
+
+    m_surfaces[surface].pending.append(feedback);
+}
+
+// The client went away, feedback objects have no requests of their own
+void PresentationTime::destroyFeedback(struct ::wl_resource *resource)
+{
+    PresentationTime *that = static_cast<PresentationTime *>(wl_resource_get_user_data(resource));
+
+    that->m_latched.removeOne(resource);
+    for (auto it = that->m_surfaces.begin(); it != that->m_surfaces.end(); ++it) {
+        it->pending.removeOne(resource);
+        it->committed.removeOne(resource);
+    }
+}
+
+// Feedback is taken out of its list first, so that destroyFeedback()
+// does not touch the list being walked.
+void PresentationTime::discard(QVector<struct ::wl_resource *> *feedback)
+{
+    const QVector<struct ::wl_resource *> resources = *feedback;
+    feedback->clear();
+
+    for (struct ::wl_resource *resource : resources) {
+        wp_presentation_feedback_send_discarded(resource);
+        wl_resource_destroy(resource);
+    }
+}
+
+void PresentationTime::surfaceCommitted(QWaylandSurface *surface)
+{
+    auto it = m_surfaces.find(surface);
+    if (it == m_surfaces.end())
+        return;
+
+    // Whatever was committed before never made it into a frame
+    discard(&it->committed);
+    it->committed = it->pending;
+    it->pending.clear();
+}
+
+void PresentationTime::surfaceDestroyed(QWaylandSurface *surface)
+{
+    auto it = m_surfaces.find(surface);
+    if (it == m_surfaces.end())
+        return;
+
+    SurfaceFeedback feedback = *it;
+    m_surfaces.erase(it);
+    discard(&feedback.pending);
+    discard(&feedback.committed);
+}
+
+// Content of visible views still waiting for its upload stays committed
+// until a later frame has it.
+void PresentationTime::frameRendered()
+{
+    for (auto it = m_surfaces.begin(); it != m_surfaces.end(); ++it) {
+        if (it->committed.isEmpty())
+            continue;
+
+        View *view = m_compositor->findView(it.key());
+        if (!view || !view->isMapped() || view->isCulled()) {
+            discard(&it->committed);
+        } else if (!view->isContentPending()) {
+            m_latched += it->committed;
+            it->committed.clear();
+        }
+    }
+}
+
+// There is no hardware refresh counter to ask, so the sequence number
+// counts refresh intervals of the monotonic clock.
+void PresentationTime::framePresented(QWaylandOutput *output, qint64 timestamp, qint64 refresh)
+{
+    if (m_latched.isEmpty())
+        return;
+
+    const QVector<struct ::wl_resource *> resources = m_latched;
+    m_latched.clear();
+
+    const quint64 seconds = quint64(timestamp / 1000000000);
+    const quint32 nanoseconds = quint32(timestamp % 1000000000);
+    const quint64 sequence = refresh > 0 ? quint64((timestamp + refresh / 2) / refresh) : 0;
+
+    QWaylandOutputPrivate *outputPrivate = output ? QWaylandOutputPrivate::get(output) : nullptr;
+
+    for (struct ::wl_resource *resource : resources) {
+        if (outputPrivate) {
+            auto outputResource = outputPrivate->resourceMap().value(wl_resource_get_client(resource));
+            if (outputResource)
+                wp_presentation_feedback_send_sync_output(resource, outputResource->handle);
+        }
+
+        wp_presentation_feedback_send_presented(resource, quint32(seconds >> 32), quint32(seconds & 0xffffffff),
+                                                nanoseconds, quint32(refresh),
+                                                quint32(sequence >> 32), quint32(sequence & 0xffffffff),
+                                                WP_PRESENTATION_FEEDBACK_KIND_VSYNC);
+        wl_resource_destroy(resource);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef PRESENTATIONTIME_H
+#define PRESENTATIONTIME_H
+
+#include <QObject>
+#include <QHash>
+#include <QVector>
+#include "qwayland-server-presentation-time.h"
+
+class QWaylandSurface;
+class QWaylandOutput;
+class Compositor;
+
+// The wp_presentation global.
+//
+// Feedback requested for a surface applies to its next commit. Once the
+// content of that commit is in a rendered frame, the feedback is latched,
+// and reported as presented when the frame is on screen. Content updates
+// that are replaced by another commit before making it into a frame, or
+// that are hidden in the frame, are discarded.
+class PresentationTime : public QObject, public QtWaylandServer::wp_presentation
+{
+    Q_OBJECT
+public:
+    explicit PresentationTime(Compositor *compositor);
+    ~PresentationTime();
+
+    // To be called once a frame has been rendered, and once it has been
+    // presented. Timestamps are CLOCK_MONOTONIC ns, refresh is 0 if the
+    // output has no constant refresh rate.
+    void frameRendered();
+    void framePresented(QWaylandOutput *output, qint64 timestamp, qint64 refresh);
+
+protected:
+    void wp_presentation_bind_resource(Resource *resource) override;
+    void wp_presentation_destroy(Resource *resource) override;
+    void wp_presentation_feedback(Resource *resource, struct ::wl_resource *surface, uint32_t callback) override;
+
+private:
+    struct SurfaceFeedback {
+        // Requested for the next commit
+        QVector<struct ::wl_resource *> pending;
+        // For the last commit, not in a frame yet
+        QVector<struct ::wl_resource *> committed;
+    };
+
+    static void destroyFeedback(struct ::wl_resource *resource);
+    void discard(QVector<struct ::wl_resource *> *feedback);
+    void surfaceCommitted(QWaylandSurface *surface);
+    void surfaceDestroyed(QWaylandSurface *surface);
+
+    Compositor *m_compositor;
+    QHash<QWaylandSurface *, SurfaceFeedback> m_surfaces;
+    // In the frame waiting to be presented
+    QVector<struct ::wl_resource *> m_latched;
+};
+
+#endif // PRESENTATIONTIME_H
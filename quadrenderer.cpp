@@ -0,0 +1,330 @@
+#include "quadrenderer.h"
+
+#include <QOpenGLShaderProgram>
+#include <QtMath>
+#include <cstring>
+#include <QDebug>
+
+#ifndef GL_TEXTURE_EXTERNAL_OES
+#define GL_TEXTURE_EXTERNAL_OES 0x8D65
+#endif
+
+enum {
+    PositionAttribute = 0,
+    TexCoordAttribute = 1,
+    OpacityAttribute = 2
+};
+
+static const char vertexShaderSource[] =
+    "attribute highp vec2 vertexPosition;\n"
+    "attribute highp vec2 vertexTexCoord;\n"
+    "attribute lowp float vertexOpacity;\n"
+    "varying highp vec2 texCoord;\n"
+    "varying lowp float opacity;\n"
+    "void main() {\n"
+    "    texCoord = vertexTexCoord;\n"
+    "    opacity = vertexOpacity;\n"
+    "    gl_Position = vec4(vertexPosition, 0.0, 1.0);\n"
+    "}\n";
+
+static const char fragmentShaderSource2D[] =
+    "varying highp vec2 texCoord;\n"
+    "varying lowp float opacity;\n"
+    "uniform sampler2D textureSampler;\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(textureSampler, texCoord) * opacity;\n"
+    "}\n";
+
+static const char fragmentShaderSourceExternal[] =
+    "#extension GL_OES_EGL_image_external : require\n"
+    "varying highp vec2 texCoord;\n"
+    "varying lowp float opacity;\n"
+    "uniform samplerExternalOES textureSampler;\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(textureSampler, texCoord) * opacity;\n"
+    "}\n";
+
+QuadRenderer::QuadRenderer()
+    : m_program2D(nullptr)
+    , m_programExternal(nullptr)
+    , m_externalFailed(false)
+    , m_vertexBuffer(QOpenGLBuffer::VertexBuffer)
+    , m_angle(0.0f)
+    , m_drawCalls(0)
+    , m_stateChanges(0)
+{
+}
+
+QuadRenderer::~QuadRenderer()
+{
+    destroy();
+}
+
+void QuadRenderer::create()
+{
+    initializeOpenGLFunctions();
+
+    m_program2D = createProgram(fragmentShaderSource2D);
+
+    m_vertexBuffer.create();
+    m_vertexBuffer.setUsagePattern(QOpenGLBuffer::StreamDraw);
+}
+
+void QuadRenderer::destroy()
+{
+    delete m_program2D;
+    m_program2D = nullptr;
+    delete m_programExternal;
+    m_programExternal = nullptr;
+    m_vertexBuffer.destroy();
+}
+
+QOpenGLShaderProgram *QuadRenderer::createProgram(const char *fragmentShaderSource)
+{
+    QOpenGLShaderProgram *program = new QOpenGLShaderProgram;
+    program->addShaderFromSourceCode(QOpenGLShader::Vertex, vertexShaderSource);
+    program->addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShaderSource);
+    program->bindAttributeLocation("vertexPosition", PositionAttribute);
+    program->bindAttributeLocation("vertexTexCoord", TexCoordAttribute);
+    program->bindAttributeLocation("vertexOpacity", OpacityAttribute);
+
+    if (!program->link()) {
+        qWarning() << "Failed to link quad shader:" << program->log();
+        delete program;
+        return nullptr;
+    }
+
+    program->bind();
+    program->setUniformValue("textureSampler", 0);
+    program->release();
+
+    return program;
+}
+
+// The external program is only built once such a texture shows up, as the
+// extension is not available everywhere.
+QOpenGLShaderProgram *QuadRenderer::programForTarget(GLenum target)
+{
+    if (target != GL_TEXTURE_EXTERNAL_OES)
+        return m_program2D;
+
+    if (!m_programExternal && !m_externalFailed) {
+        m_programExternal = createProgram(fragmentShaderSourceExternal);
+        m_externalFailed = !m_programExternal;
+    }
+
+    return m_programExternal;
+}
+
+// Same placement QOpenGLTextureBlitter::targetTransform() followed by a
+// rotation around the z axis would give, folded into a single affine 2D
+// transform so that no 4x4 matrix has to be built per quad.
+QTransform QuadRenderer::outputTransform(const QRectF &geometry, const QSize &viewport, float angle)
+{
+    if (geometry.isEmpty() || viewport.isEmpty())
+        return QTransform();
+
+    qreal c, s;
+    switch (qRound(angle) % 360) {
+    case 0:
+        c = 1; s = 0;
+        break;
+    case 90:
+        c = 0; s = 1;
+        break;
+    case 180:
+        c = -1; s = 0;
+        break;
+    case 270:
+        c = 0; s = -1;
+        break;
+    default:
+        c = qCos(qDegreesToRadians(qreal(angle)));
+        s = qSin(qDegreesToRadians(qreal(angle)));
+        break;
+    }
+
+    const qreal w = geometry.width();
+    const qreal h = geometry.height();
+    const qreal sx = w / viewport.width();
+    const qreal sy = h / viewport.height();
+    const qreal tx = sx - 1 + geometry.x() / viewport.width() * 2;
+    const qreal ty = -sy + 1 - geometry.y() / viewport.height() * 2;
+
+    // Surface-local (u, v) is first mapped to the unit quad, with the top
+    // of the image at y = 1, then rotated, then scaled and translated.
+    const qreal ax = 2 / w;
+    const qreal ay = -2 / h;
+
+    return QTransform(sx * c * ax, sy * s * ax,
+                      -sx * s * ay, sy * c * ay,
+                      sx * (-c - s) + tx, sy * (c - s) + ty);
+}
+
+void QuadRenderer::begin(const QSize &viewport, float angle)
+{
+    m_viewport = viewport;
+    m_angle = angle;
+    m_quads.clear();
+    m_drawCalls = 0;
+    m_stateChanges = 0;
+}
+
+void QuadRenderer::addQuad(GLuint textureId, GLenum target, const QRectF &geometry,
+                           QOpenGLTextureBlitter::Origin origin, bool blend, float opacity,
+                           const QRectF &textureRect)
+{
+    addQuad(textureId, target, outputTransform(geometry, m_viewport, m_angle),
+            geometry.size(), origin, blend, opacity, textureRect);
+}
+
+void QuadRenderer::addQuad(GLuint textureId, GLenum target, const QTransform &transform, const QSizeF &size,
+                           QOpenGLTextureBlitter::Origin origin, bool blend, float opacity,
+                           const QRectF &textureRect)
+{
+    if (!textureId || size.isEmpty())
+        return;
+
+    m_quads.resize(m_quads.count() + 1);
+    Quad &quad = m_quads.last();
+    quad.texture = textureId;
+    quad.target = target;
+    quad.blend = blend;
+    quad.batch = -1;
+    quad.bounds = transform.mapRect(QRectF(QPointF(), size));
+
+    const qreal w = size.width();
+    const qreal h = size.height();
+    const bool topLeft = origin == QOpenGLTextureBlitter::OriginTopLeft;
+
+    // Two triangles: top left, bottom left, top right, bottom left, top right, bottom right
+    static const int corners[VerticesPerQuad][2] = { { 0, 0 }, { 0, 1 }, { 1, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 } };
+
+    GLfloat *v = quad.vertices;
+    for (int i = 0; i < VerticesPerQuad; i++) {
+        const int cx = corners[i][0];
+        const int cy = corners[i][1];
+        const QPointF position = transform.map(QPointF(cx * w, cy * h));
+        const qreal t = textureRect.top() + cy * textureRect.height();
+        *v++ = position.x();
+        *v++ = position.y();
+        *v++ = textureRect.left() + cx * textureRect.width();
+        *v++ = topLeft ? t : 1 - t;
+        *v++ = opacity;
+    }
+}
+
+void QuadRenderer::end()
+{
+    if (m_quads.isEmpty())
+        return;
+
+    // A quad may join an earlier batch with the same state as long as
+    // nothing queued in between overlaps it, so reordering it can't change
+    // the result of blending.
+    m_batches.clear();
+    for (int i = 0; i < m_quads.count(); i++) {
+        Quad &quad = m_quads[i];
+
+        for (int b = m_batches.count() - 1; b >= 0; b--) {
+            const Batch &candidate = m_batches.at(b);
+            if (candidate.target == quad.target && candidate.blend == quad.blend) {
+                quad.batch = b;
+                break;
+            }
+            if (candidate.bounds.intersects(quad.bounds))
+                break;
+        }
+
+        if (quad.batch < 0) {
+            Batch batch = { quad.target, quad.blend, QRectF(), 0, 0 };
+            m_batches.append(batch);
+            quad.batch = m_batches.count() - 1;
+        }
+
+        Batch &batch = m_batches[quad.batch];
+        batch.bounds |= quad.bounds;
+        batch.count++;
+    }
+
+    int first = 0;
+    for (Batch &batch : m_batches) {
+        batch.first = first;
+        first += batch.count;
+        batch.count = 0;
+    }
+
+    m_order.resize(m_quads.count());
+    m_vertices.resize(m_quads.count() * FloatsPerQuad);
+    for (int i = 0; i < m_quads.count(); i++) {
+        const Quad &quad = m_quads.at(i);
+        Batch &batch = m_batches[quad.batch];
+        const int slot = batch.first + batch.count++;
+        m_order[slot] = i;
+        memcpy(m_vertices.data() + slot * FloatsPerQuad, quad.vertices, sizeof(quad.vertices));
+    }
+
+    m_vertexBuffer.bind();
+    m_vertexBuffer.allocate(m_vertices.constData(), m_vertices.count() * sizeof(GLfloat));
+
+    const int stride = FloatsPerVertex * sizeof(GLfloat);
+    glEnableVertexAttribArray(PositionAttribute);
+    glEnableVertexAttribArray(TexCoordAttribute);
+    glEnableVertexAttribArray(OpacityAttribute);
+    glVertexAttribPointer(PositionAttribute, 2, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<const void *>(0));
+    glVertexAttribPointer(TexCoordAttribute, 2, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<const void *>(2 * sizeof(GLfloat)));
+    glVertexAttribPointer(OpacityAttribute, 1, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<const void *>(4 * sizeof(GLfloat)));
+
+    glActiveTexture(GL_TEXTURE0);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    QOpenGLShaderProgram *currentProgram = nullptr;
+    bool blending = false;
+    glDisable(GL_BLEND);
+
+    for (const Batch &batch : qAsConst(m_batches)) {
+        QOpenGLShaderProgram *program = programForTarget(batch.target);
+        if (!program)
+            continue;
+
+        if (program != currentProgram) {
+            program->bind();
+            currentProgram = program;
+            m_stateChanges++;
+        }
+
+        if (batch.blend != blending) {
+            blending = batch.blend;
+            if (blending)
+                glEnable(GL_BLEND);
+            else
+                glDisable(GL_BLEND);
+            m_stateChanges++;
+        }
+
+        int runStart = batch.first;
+        for (int slot = batch.first; slot < batch.first + batch.count; slot++) {
+            const GLuint texture = m_quads.at(m_order.at(slot)).texture;
+            const bool lastInRun = slot + 1 == batch.first + batch.count
+                    || m_quads.at(m_order.at(slot + 1)).texture != texture;
+            if (!lastInRun)
+                continue;
+
+            glBindTexture(batch.target, texture);
+            glDrawArrays(GL_TRIANGLES, runStart * VerticesPerQuad, (slot + 1 - runStart) * VerticesPerQuad);
+            m_drawCalls++;
+            runStart = slot + 1;
+        }
+
+        glBindTexture(batch.target, 0);
+    }
+
+    if (currentProgram)
+        currentProgram->release();
+
+    glDisable(GL_BLEND);
+    glDisableVertexAttribArray(PositionAttribute);
+    glDisableVertexAttribArray(TexCoordAttribute);
+    glDisableVertexAttribArray(OpacityAttribute);
+    m_vertexBuffer.release();
+}
@@ -0,0 +1,92 @@
+#ifndef QUADRENDERER_H
+#define QUADRENDERER_H
+
+#include <QOpenGLFunctions>
+#include <QOpenGLBuffer>
+#include <QOpenGLTextureBlitter>
+#include <QTransform>
+#include <QVector>
+
+class QOpenGLShaderProgram;
+
+// Draws all textured quads of a frame from a single vertex buffer.
+//
+// Quads are queued back to front between begin() and end(). When the frame
+// is submitted, quads are grouped by texture target and blend state as far
+// as the stacking order allows, so that the number of program and state
+// changes stays small, and consecutive quads sharing a texture are drawn
+// with a single call. Textures are expected to hold premultiplied alpha,
+// as Wayland clients provide it.
+class QuadRenderer : protected QOpenGLFunctions
+{
+public:
+    QuadRenderer();
+    ~QuadRenderer();
+
+    void create();
+    void destroy();
+
+    // Maps surface-local coordinates of something placed at geometry (in
+    // output coordinates) to normalized device coordinates, rotated by angle
+    // around the center of the placed rectangle.
+    static QTransform outputTransform(const QRectF &geometry, const QSize &viewport, float angle);
+
+    void begin(const QSize &viewport, float angle);
+    // textureRect is the part of the texture drawn, in normalized
+    // texture coordinates with the origin at the top left of the content.
+    void addQuad(GLuint textureId, GLenum target, const QRectF &geometry,
+                 QOpenGLTextureBlitter::Origin origin, bool blend, float opacity = 1.0f,
+                 const QRectF &textureRect = QRectF(0, 0, 1, 1));
+    void addQuad(GLuint textureId, GLenum target, const QTransform &transform, const QSizeF &size,
+                 QOpenGLTextureBlitter::Origin origin, bool blend, float opacity = 1.0f,
+                 const QRectF &textureRect = QRectF(0, 0, 1, 1));
+    void end();
+
+    int drawCalls() const { return m_drawCalls; }
+    int stateChanges() const { return m_stateChanges; }
+
+private:
+    enum {
+        FloatsPerVertex = 5,
+        VerticesPerQuad = 6,
+        FloatsPerQuad = FloatsPerVertex * VerticesPerQuad
+    };
+
+    struct Quad {
+        GLuint texture;
+        GLenum target;
+        bool blend;
+        int batch;
+        QRectF bounds;
+        GLfloat vertices[FloatsPerQuad];
+    };
+
+    struct Batch {
+        GLenum target;
+        bool blend;
+        QRectF bounds;
+        int first;
+        int count;
+    };
+
+    QOpenGLShaderProgram *programForTarget(GLenum target);
+    QOpenGLShaderProgram *createProgram(const char *fragmentShaderSource);
+
+    QOpenGLShaderProgram *m_program2D;
+    QOpenGLShaderProgram *m_programExternal;
+    bool m_externalFailed;
+    QOpenGLBuffer m_vertexBuffer;
+
+    QSize m_viewport;
+    float m_angle;
+
+    QVector<Quad> m_quads;
+    QVector<Batch> m_batches;
+    QVector<int> m_order;
+    QVector<GLfloat> m_vertices;
+
+    int m_drawCalls;
+    int m_stateChanges;
+};
+
+#endif // QUADRENDERER_H
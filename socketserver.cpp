@@ -3,38 +3,40 @@
 #include <QLocalSocket>
 #include <QJsonDocument>
 #include <QFile>
+#include <cstring>
+
+// Longest message accepted, including its terminator
+static const int maxMessageSize = 64 * 1024;
+// Clients that don't read their replies are dropped once this much is
+// still pending. A single larger reply, like a trace dump, is fine.
+static const qint64 maxPendingReplyBytes = 1024 * 1024;
 
 SocketServer::SocketServer(const QString &path, QObject *parent) :
     QObject(parent),
     path(path),
-    localServer(this)
+    localServer(this),
+    m_messagesReceived(0),
+    m_errors(0)
 {
     QObject::connect(&localServer, &QLocalServer::newConnection, this, [this]() {
-        QLocalSocket *socketClient = localServer.nextPendingConnection();
-
-        if (!socketClient)
-            return;
-
-        QObject::connect(socketClient, &QLocalSocket::readyRead, [this, socketClient]() {
-            QByteArray buf = socketClient->readAll();
-            QList<QByteArray> messages = buf.split(0);
+        while (QLocalSocket *socketClient = localServer.nextPendingConnection()) {
+            Connection connection = { UnknownProtocol, QByteArray(), 0, false };
+            m_connections.insert(socketClient, connection);
 
-            foreach (QByteArray message, messages) {
-                QJsonDocument doc = QJsonDocument::fromJson(message);
+            QObject::connect(socketClient, &QLocalSocket::readyRead, this, [this, socketClient]() {
+                readMessages(socketClient);
+            });
 
-                if (!doc.isObject())
-                    return;
-
-                QJsonObject obj = doc.object();
-                emit jsonReceived(obj);
-            }
-        });
+            QObject::connect(socketClient, &QLocalSocket::disconnected, this, [this, socketClient]() {
+                m_connections.remove(socketClient);
+                socketClient->deleteLater();
+            });
+        }
     });
 }
 
 bool SocketServer::start()
 {
-    localServer.setMaxPendingConnections(1);
     QFile::remove(path);
     if (localServer.listen(path)) {
         qInfo() << "Listening on" << localServer.serverName();
@@ -44,3 +46,146 @@ bool SocketServer::start()
     qWarning() << "Error listening on" << localServer.serverName() << ":" << localServer.serverError();
     return false;
 }
+
+void SocketServer::readMessages(QLocalSocket *socket)
+{
+    auto it = m_connections.find(socket);
+    if (it == m_connections.end())
+        return;
+
+    it->buffer += socket->readAll();
+
+    if (it->protocol == UnknownProtocol && !it->buffer.isEmpty()) {
+        if (it->buffer.at(0) == ControlProtocol::BinaryMagic) {
+            it->protocol = BinaryProtocol;
+            it->buffer.remove(0, 1);
+        } else {
+            it->protocol = JsonProtocol;
+        }
+    }
+
+    if (it->protocol == BinaryProtocol) {
+        readBinaryMessages(socket, *it);
+        return;
+    }
+
+    // Messages are cut out of the buffer in place, and the remainder is
+    // moved to the front once per read.
+    int start = 0;
+    for (;;) {
+        const int end = it->buffer.indexOf('\0', start + it->scanned);
+        if (end < 0)
+            break;
+
+        // Whole messages that came in with one read are held to the same
+        // limit as ones still being buffered
+        if (it->discarding)
+            it->discarding = false;
+        else if (end - start >= maxMessageSize)
+            sendError(socket, QStringLiteral("Message too long"));
+        else if (end > start)
+            handleMessage(socket, QByteArray::fromRawData(it->buffer.constData() + start, end - start));
+
+        // A reply may have made the client go away
+        it = m_connections.find(socket);
+        if (it == m_connections.end())
+            return;
+
+        start = end + 1;
+        it->scanned = 0;
+    }
+
+    it->buffer.remove(0, start);
+    it->scanned = it->buffer.size();
+
+    if (it->buffer.size() >= maxMessageSize) {
+        if (!it->discarding)
+            sendError(socket, QStringLiteral("Message too long"));
+        it->discarding = true;
+        it->buffer.clear();
+        it->scanned = 0;
+    }
+}
+
+// Binary messages have a fixed size, so whatever is left over is always
+// shorter than one message.
+void SocketServer::readBinaryMessages(QLocalSocket *socket, Connection &connection)
+{
+    const QByteArray buffer = connection.buffer;
+    const int count = buffer.size() / int(sizeof(ControlMessage));
+    connection.buffer.remove(0, count * int(sizeof(ControlMessage)));
+
+    for (int i = 0; i < count; i++) {
+        m_messagesReceived++;
+
+        ControlMessage message;
+        memcpy(&message, buffer.constData() + i * sizeof(ControlMessage), sizeof(message));
+
+        ControlCommand command;
+        if (!ControlProtocol::decodeBinary(message, &command)) {
+            sendError(socket, QStringLiteral("Unknown command ") + QString::number(message.type));
+        } else {
+            QJsonObject reply;
+            emit commandReceived(command, &reply);
+            if (!reply.isEmpty())
+                sendReply(socket, reply);
+        }
+
+        if (!m_connections.contains(socket))
+            return;
+    }
+}
+
+void SocketServer::handleMessage(QLocalSocket *socket, const QByteArray &message)
+{
+    m_messagesReceived++;
+
+    QJsonParseError error;
+    const QJsonDocument doc = QJsonDocument::fromJson(message, &error);
+
+    if (error.error != QJsonParseError::NoError) {
+        sendError(socket, QStringLiteral("Invalid JSON: ") + error.errorString());
+        return;
+    }
+
+    if (!doc.isObject()) {
+        sendError(socket, QStringLiteral("Expected a JSON object"));
+        return;
+    }
+
+    QVector<ControlCommand> commands;
+    QString decodeError;
+    if (!ControlProtocol::decodeJson(doc.object(), &commands, &decodeError)) {
+        sendError(socket, decodeError);
+        return;
+    }
+
+    QJsonObject reply;
+    for (const ControlCommand &command : qAsConst(commands))
+        emit commandReceived(command, &reply);
+
+    if (!reply.isEmpty())
+        sendReply(socket, reply);
+}
+
+void SocketServer::sendReply(QLocalSocket *socket, const QJsonObject &reply)
+{
+    if (socket->bytesToWrite() > maxPendingReplyBytes) {
+        qWarning() << "Dropping control socket client that does not read its replies";
+        socket->abort();
+        return;
+    }
+
+    QByteArray data = QJsonDocument(reply).toJson(QJsonDocument::Compact);
+    data.append('\0');
+    socket->write(data);
+}
+
+void SocketServer::sendError(QLocalSocket *socket, const QString &error)
+{
+    m_errors++;
+
+    QJsonObject reply;
+    reply["error"] = error;
+    sendReply(socket, reply);
+}
@@ -4,7 +4,16 @@
 #include <QObject>
 #include <QLocalServer>
 #include <QJsonObject>
+#include <QHash>
+#include "controlprotocol.h"
 
+class QLocalSocket;
+
+// Accepts any number of clients sending commands, either as JSON objects
+// terminated by NUL bytes or in the binary encoding of ControlProtocol,
+// picked by the first byte of a connection. Messages may be split across
+// reads or arrive several at once. Replies and errors are sent back on
+// the same connection as NUL-terminated JSON.
 class SocketServer : public QObject
 {
     Q_OBJECT
@@ -12,14 +21,43 @@ public:
     explicit SocketServer(const QString &path, QObject *parent = nullptr);
     bool start();
 
+    quint64 messagesReceived() const { return m_messagesReceived; }
+    quint64 errors() const { return m_errors; }
+    int connectionCount() const { return m_connections.count(); }
+
 signals:
-    void jsonReceived(const QJsonObject &obj);
+    // Receivers may fill in reply, which is then sent back to the client
+    void commandReceived(const ControlCommand &command, QJsonObject *reply);
 
 public slots:
 
 private:
+    enum Protocol {
+        UnknownProtocol,
+        JsonProtocol,
+        BinaryProtocol
+    };
+
+    struct Connection {
+        Protocol protocol;
+        QByteArray buffer;
+        // Bytes of buffer already known to contain no terminator
+        int scanned;
+        // Set after an oversized message, until its terminator shows up
+        bool discarding;
+    };
+
+    void readMessages(QLocalSocket *socket);
+    void readBinaryMessages(QLocalSocket *socket, Connection &connection);
+    void handleMessage(QLocalSocket *socket, const QByteArray &message);
+    void sendReply(QLocalSocket *socket, const QJsonObject &reply);
+    void sendError(QLocalSocket *socket, const QString &error);
+
     QString path;
     QLocalServer localServer;
+    QHash<QLocalSocket*, Connection> m_connections;
+    quint64 m_messagesReceived;
+    quint64 m_errors;
 };
 
 #endif // SOCKETSERVER_H
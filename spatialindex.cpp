@@ -0,0 +1,103 @@
+#include "spatialindex.h"
+#include "compositor.h"
+
+#include <QtMath>
+
+SpatialIndex::SpatialIndex(int cellSize)
+    : m_cellSize(cellSize)
+    , m_columns(0)
+    , m_rows(0)
+{
+}
+
+void SpatialIndex::setBounds(const QRect &bounds)
+{
+    m_bounds = bounds;
+    m_columns = (bounds.width() + m_cellSize - 1) / m_cellSize;
+    m_rows = (bounds.height() + m_cellSize - 1) / m_cellSize;
+
+    m_cells.clear();
+    m_cells.resize(m_columns * m_rows);
+
+    for (auto it = m_geometries.constBegin(); it != m_geometries.constEnd(); ++it)
+        insertIntoCells(it.key(), it.value());
+}
+
+// Cells touched by geometry, as columns and rows; empty if it lies outside
+QRect SpatialIndex::cellRange(const QRectF &geometry) const
+{
+    const QRectF clipped = geometry & QRectF(m_bounds);
+    if (clipped.isEmpty())
+        return QRect();
+
+    const int left = qFloor((clipped.left() - m_bounds.left()) / m_cellSize);
+    const int top = qFloor((clipped.top() - m_bounds.top()) / m_cellSize);
+    const int right = qMin(m_columns - 1, qFloor((clipped.right() - m_bounds.left()) / m_cellSize));
+    const int bottom = qMin(m_rows - 1, qFloor((clipped.bottom() - m_bounds.top()) / m_cellSize));
+
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+void SpatialIndex::insertIntoCells(View *view, const QRectF &geometry)
+{
+    const QRect range = cellRange(geometry);
+    for (int row = range.top(); row <= range.bottom(); row++) {
+        for (int column = range.left(); column <= range.right(); column++)
+            m_cells[row * m_columns + column].append(view);
+    }
+}
+
+void SpatialIndex::removeFromCells(View *view, const QRectF &geometry)
+{
+    const QRect range = cellRange(geometry);
+    for (int row = range.top(); row <= range.bottom(); row++) {
+        for (int column = range.left(); column <= range.right(); column++)
+            m_cells[row * m_columns + column].removeOne(view);
+    }
+}
+
+void SpatialIndex::update(View *view, const QRectF &geometry)
+{
+    auto it = m_geometries.find(view);
+    if (it != m_geometries.end()) {
+        if (it.value() == geometry)
+            return;
+        removeFromCells(view, it.value());
+        it.value() = geometry;
+    } else {
+        m_geometries.insert(view, geometry);
+    }
+
+    insertIntoCells(view, geometry);
+}
+
+void SpatialIndex::remove(View *view)
+{
+    auto it = m_geometries.find(view);
+    if (it == m_geometries.end())
+        return;
+
+    removeFromCells(view, it.value());
+    m_geometries.erase(it);
+}
+
+View *SpatialIndex::viewAt(const QPointF &point) const
+{
+    if (!QRectF(m_bounds).contains(point))
+        return nullptr;
+
+    const int column = qMin(m_columns - 1, qFloor((point.x() - m_bounds.left()) / m_cellSize));
+    const int row = qMin(m_rows - 1, qFloor((point.y() - m_bounds.top()) / m_cellSize));
+
+    View *top = nullptr;
+    for (View *view : m_cells.at(row * m_columns + column)) {
+        if (top && view->stackingIndex() < top->stackingIndex())
+            continue;
+        if (view->isCursor() || !view->isMapped())
+            continue;
+        if (m_geometries.value(view).contains(point))
+            top = view;
+    }
+
+    return top;
+}
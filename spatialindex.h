@@ -0,0 +1,42 @@
+#ifndef SPATIALINDEX_H
+#define SPATIALINDEX_H
+
+#include <QRect>
+#include <QRectF>
+#include <QHash>
+#include <QVector>
+
+class View;
+
+// Uniform grid over the output for finding the view under a point.
+//
+// Every view is listed in the cells its absolute geometry touches, so a
+// hit test only looks at the few views sharing the cell of the point and
+// picks the topmost of them by stacking index.
+class SpatialIndex
+{
+public:
+    explicit SpatialIndex(int cellSize = 128);
+
+    // Anything outside of the bounds is never hit
+    void setBounds(const QRect &bounds);
+
+    void update(View *view, const QRectF &geometry);
+    void remove(View *view);
+
+    View *viewAt(const QPointF &point) const;
+
+private:
+    void insertIntoCells(View *view, const QRectF &geometry);
+    void removeFromCells(View *view, const QRectF &geometry);
+    QRect cellRange(const QRectF &geometry) const;
+
+    int m_cellSize;
+    QRect m_bounds;
+    int m_columns;
+    int m_rows;
+    QVector<QVector<View*> > m_cells;
+    QHash<View*, QRectF> m_geometries;
+};
+
+#endif // SPATIALINDEX_H
@@ -0,0 +1,47 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QAtomicInt>
+
+// Bounded queue for exactly one producer thread and one consumer thread.
+// Neither side takes a lock; the producer only writes the tail and the
+// consumer only writes the head. One slot is kept free to tell a full
+// queue from an empty one.
+template <typename T, int Capacity>
+class SpscQueue
+{
+public:
+    SpscQueue() : m_head(0), m_tail(0) {}
+
+    // Producer side. Returns false if the queue is full.
+    bool push(const T &value)
+    {
+        const int tail = m_tail.load();
+        const int next = (tail + 1) % Capacity;
+        if (next == m_head.loadAcquire())
+            return false;
+
+        m_items[tail] = value;
+        m_tail.storeRelease(next);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T *value)
+    {
+        const int head = m_head.load();
+        if (head == m_tail.loadAcquire())
+            return false;
+
+        *value = m_items[head];
+        m_head.storeRelease((head + 1) % Capacity);
+        return true;
+    }
+
+private:
+    T m_items[Capacity];
+    QAtomicInt m_head;
+    QAtomicInt m_tail;
+};
+
+#endif // SPSCQUEUE_H
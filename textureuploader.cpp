@@ -0,0 +1,489 @@
+#include "textureuploader.h"
+#include "trace.h"
+
+#include <QOpenGLContext>
+#include <QOffscreenSurface>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QtWaylandCompositor/private/qwaylandcompositor_p.h>
+#include <QtWaylandCompositor/private/qwlclientbuffer_p.h>
+
+#include <wayland-server.h>
+#include <cstring>
+
+#ifndef GL_BGRA
+#define GL_BGRA 0x80E1
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_TIMEOUT_EXPIRED
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+
+// Damage split into more rectangles than this is uploaded as its bounding rectangle
+static const int maxUploadRects = 16;
+
+// Formats whose bytes are laid out as B, G, R, A in memory
+static bool isBgraFormat(QImage::Format format)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    return format == QImage::Format_RGB32
+            || format == QImage::Format_ARGB32
+            || format == QImage::Format_ARGB32_Premultiplied;
+#else
+    Q_UNUSED(format);
+    return false;
+#endif
+}
+
+static bool isRgbaFormat(QImage::Format format)
+{
+    return format == QImage::Format_RGBA8888
+            || format == QImage::Format_RGBA8888_Premultiplied
+            || format == QImage::Format_RGBX8888;
+}
+
+ShmTexture::ShmTexture()
+    : m_front(-1)
+    , m_uploading(false)
+    , m_released(false)
+{
+    for (int i = 0; i < 2; i++) {
+        m_textures[i] = 0;
+        m_formats[i] = QImage::Format_Invalid;
+    }
+}
+
+int ShmTexture::buffersHeld() const
+{
+    return (m_uploading ? 1 : 0) + (m_queuedBuffer.isNull() ? 0 : 1);
+}
+
+TextureUploader::TextureUploader(QWaylandCompositor *compositor, QObject *parent)
+    : QThread(parent)
+    , m_compositor(compositor)
+    , m_context(nullptr)
+    , m_surface(nullptr)
+    , m_bgra(false)
+    , m_bgraInternalFormat(GL_RGBA)
+    , m_uploadedBytes(0)
+    , m_quit(false)
+{
+    setObjectName(QStringLiteral("upload"));
+}
+
+TextureUploader::~TextureUploader()
+{
+    stop();
+    qDeleteAll(m_textures);
+}
+
+void TextureUploader::create(QOpenGLContext *shareContext)
+{
+    // GLES wants the internal format to match the BGRA source format
+    if (shareContext->isOpenGLES()) {
+        m_bgra = shareContext->hasExtension("GL_EXT_texture_format_BGRA8888");
+        m_bgraInternalFormat = GL_BGRA;
+    } else {
+        m_bgra = true;
+        m_bgraInternalFormat = GL_RGBA;
+    }
+
+    // Pixel buffer objects, buffer mapping and fences
+    const QSurfaceFormat format = shareContext->format();
+    const bool capable = shareContext->isOpenGLES()
+            ? format.majorVersion() >= 3
+            : format.version() >= qMakePair(3, 2);
+
+    if (!capable || qEnvironmentVariableIsSet("NUBBOCK_SYNC_UPLOAD")) {
+        qInfo() << "Uploading shm buffers synchronously";
+        return;
+    }
+
+    QOpenGLContext *context = new QOpenGLContext;
+    context->setFormat(format);
+    context->setShareContext(shareContext);
+
+    QOffscreenSurface *surface = new QOffscreenSurface;
+    surface->setFormat(format);
+    surface->create();
+
+    // Make sure the context is usable before handing it to the worker
+    QSurface *shareSurface = shareContext->surface();
+    const bool usable = context->create() && context->makeCurrent(surface);
+    shareContext->makeCurrent(shareSurface);
+
+    if (!usable) {
+        qWarning() << "Failed to set up the upload context, uploading shm buffers synchronously";
+        delete context;
+        delete surface;
+        return;
+    }
+
+    context->moveToThread(this);
+    m_context = context;
+    m_surface = surface;
+    m_quit = false;
+    start();
+}
+
+void TextureUploader::stop()
+{
+    if (!m_context)
+        return;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+        m_condition.wakeOne();
+    }
+    wait();
+
+    const QList<Job> jobs = m_jobs + m_finished + m_waiting;
+    for (const Job &job : jobs) {
+        if (job.pool)
+            wl_shm_pool_unref(job.pool);
+    }
+
+    delete m_context;
+    m_context = nullptr;
+    delete m_surface;
+    m_surface = nullptr;
+}
+
+ShmTexture *TextureUploader::createTexture()
+{
+    ShmTexture *texture = new ShmTexture;
+    m_textures.append(texture);
+    return texture;
+}
+
+// Only one upload per texture is in flight at a time. A buffer committed
+// meanwhile waits, replacing any other buffer that was waiting before, and
+// their damage is merged.
+void TextureUploader::upload(ShmTexture *texture, const QWaylandBufferRef &buffer, const QRegion &damage,
+                             bool attached)
+{
+    // Without a new attach, the buffer is the one uploaded before, which
+    // may have been released already and be drawn into again by now.
+    if (!attached)
+        return;
+
+    texture->m_queuedBuffer = buffer;
+    texture->m_queuedDamage += damage;
+    if (!texture->m_uploading)
+        submit(texture);
+}
+
+quint64 TextureUploader::takeUploadedBytes()
+{
+    const quint64 bytes = m_uploadedBytes;
+    m_uploadedBytes = 0;
+    return bytes;
+}
+
+void TextureUploader::submit(ShmTexture *texture)
+{
+    QWaylandBufferRef buffer = texture->m_queuedBuffer;
+    const QRegion damage = texture->m_queuedDamage;
+    texture->m_queuedBuffer = QWaylandBufferRef();
+    texture->m_queuedDamage = QRegion();
+
+    const QImage image = buffer.image();
+    if (image.isNull())
+        return;
+
+    const int front = texture->m_front;
+    const int back = front == 0 ? 1 : 0;
+    if (!texture->m_textures[back]) {
+        QOpenGLFunctions *f = QOpenGLContext::currentContext()->functions();
+        f->glGenTextures(1, &texture->m_textures[back]);
+        f->glBindTexture(GL_TEXTURE_2D, texture->m_textures[back]);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        f->glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    Job job;
+    job.texture = texture;
+    job.textureId = texture->m_textures[back];
+    job.image = image;
+    job.pool = nullptr;
+    job.reallocate = texture->m_sizes[back] != image.size() || texture->m_formats[back] != image.format();
+    job.fence = 0;
+
+    // The back texture is missing this commit's damage and whatever was
+    // uploaded into the front one the last time around.
+    const QRegion region = job.reallocate
+            ? QRegion(image.rect())
+            : (damage + texture->m_stale[back]) & image.rect();
+    if (region.rectCount() > maxUploadRects)
+        job.rects.append(region.boundingRect());
+    else
+        for (const QRect &rect : region)
+            job.rects.append(rect);
+
+    for (const QRect &rect : qAsConst(job.rects))
+        m_uploadedBytes += quint64(rect.width()) * rect.height() * 4;
+
+    texture->m_stale[back] = QRegion();
+    if (front >= 0)
+        texture->m_stale[front] += damage;
+    texture->m_sizes[back] = image.size();
+    texture->m_formats[back] = image.format();
+    texture->m_uploading = true;
+    texture->m_uploadingBuffer = buffer;
+
+    if (job.rects.isEmpty() || !isAsynchronous()) {
+        uploadImage(QOpenGLContext::currentContext()->functions(), nullptr, job, 0);
+        finish(job);
+        return;
+    }
+
+    // The image points straight into the client's pool, keep it mapped
+    // even if the client destroys the buffer while the worker copies it.
+    if (struct wl_shm_buffer *shmBuffer = wl_shm_buffer_get(buffer.wl_buffer()))
+        job.pool = wl_shm_buffer_ref_pool(shmBuffer);
+
+    QMutexLocker locker(&m_mutex);
+    m_jobs.append(job);
+    m_condition.wakeOne();
+}
+
+void TextureUploader::finish(Job &job)
+{
+    if (job.pool) {
+        wl_shm_pool_unref(job.pool);
+        job.pool = nullptr;
+    }
+
+    ShmTexture *texture = job.texture;
+    texture->m_front = texture->m_textures[0] == job.textureId ? 0 : 1;
+    texture->m_uploading = false;
+
+    // The pixels are in our texture now. QtWayland keeps a reference to the
+    // buffer as long as it is attached, so release it to the client here.
+    QWaylandBufferRef buffer = texture->m_uploadingBuffer;
+    texture->m_uploadingBuffer = QWaylandBufferRef();
+    releaseBuffer(buffer);
+
+    if (texture->m_released)
+        texture->m_queuedBuffer = QWaylandBufferRef();
+    else if (!texture->m_queuedBuffer.isNull())
+        submit(texture);
+}
+
+// Released through QtWayland's own buffer, which marks it as no longer
+// committed. QtWayland then won't release it a second time when it lets
+// go of it, only once it is attached and committed again.
+void TextureUploader::releaseBuffer(const QWaylandBufferRef &buffer)
+{
+    if (buffer.isNull() || buffer.isDestroyed() || !buffer.wl_buffer())
+        return;
+
+    QtWayland::ClientBuffer *clientBuffer = QWaylandCompositorPrivate::get(m_compositor)->getBuffer(buffer.wl_buffer());
+    if (clientBuffer && clientBuffer->isCommitted())
+        clientBuffer->sendRelease();
+}
+
+// Promotes uploads whose fences have signaled, without ever blocking on
+// one that hasn't. Also frees textures that were released by their owners.
+void TextureUploader::collect()
+{
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+
+    if (isAsynchronous()) {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_waiting += m_finished;
+            m_finished.clear();
+        }
+
+        QOpenGLExtraFunctions *ef = context->extraFunctions();
+        for (auto it = m_waiting.begin(); it != m_waiting.end();) {
+            if (ef->glClientWaitSync(it->fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+                ++it;
+                continue;
+            }
+
+            ef->glDeleteSync(it->fence);
+            Job job = *it;
+            it = m_waiting.erase(it);
+            finish(job);
+        }
+    }
+
+    QOpenGLFunctions *f = context->functions();
+    for (auto it = m_textures.begin(); it != m_textures.end();) {
+        ShmTexture *texture = *it;
+        if (!texture->m_released || texture->m_uploading) {
+            ++it;
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (texture->m_textures[i])
+                f->glDeleteTextures(1, &texture->m_textures[i]);
+        }
+        delete texture;
+        it = m_textures.erase(it);
+    }
+}
+
+void TextureUploader::run()
+{
+    if (!m_context->makeCurrent(m_surface))
+        qWarning() << "Failed to make the upload context current";
+
+    QOpenGLFunctions *f = m_context->functions();
+    QOpenGLExtraFunctions *ef = m_context->extraFunctions();
+
+    // Alternate between two buffers so that filling one never waits for
+    // the GPU to finish reading the other.
+    GLuint pbos[2];
+    f->glGenBuffers(2, pbos);
+    int nextPbo = 0;
+
+    forever {
+        Job job;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_jobs.isEmpty() && !m_quit)
+                m_condition.wait(&m_mutex);
+            if (m_quit)
+                break;
+            job = m_jobs.takeFirst();
+        }
+
+        uploadImage(f, ef, job, pbos[nextPbo]);
+        nextPbo = 1 - nextPbo;
+
+        job.fence = ef->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        f->glFlush();
+
+        {
+            QMutexLocker locker(&m_mutex);
+            m_finished.append(job);
+        }
+        emit uploadFinished();
+    }
+
+    f->glDeleteBuffers(2, pbos);
+    m_context->doneCurrent();
+    m_context->moveToThread(QCoreApplication::instance()->thread());
+}
+
+// Uploads the job's rectangles. With a pixel buffer object they are all
+// packed into it first, one after the other, so a single mapping covers
+// the whole upload.
+void TextureUploader::uploadImage(QOpenGLFunctions *f, QOpenGLExtraFunctions *ef, const Job &job, GLuint pbo)
+{
+    if (job.rects.isEmpty())
+        return;
+
+    QImage image = job.image;
+    if (!isBgraFormat(image.format()) && !isRgbaFormat(image.format()))
+        image = image.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
+
+    const bool bgra = m_bgra && isBgraFormat(image.format());
+    const GLenum format = bgra ? GL_BGRA : GL_RGBA;
+    const GLenum internalFormat = bgra ? m_bgraInternalFormat : GL_RGBA;
+    const bool swizzle = !bgra && isBgraFormat(image.format());
+
+    int bytes = 0;
+    for (const QRect &rect : job.rects)
+        bytes += rect.width() * rect.height() * 4;
+
+    TRACE_SCOPE(Upload, "upload", bytes);
+
+    uchar *mapped = nullptr;
+    if (pbo) {
+        f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        f->glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        mapped = static_cast<uchar *>(ef->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                                           GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (!mapped) {
+            qWarning() << "Failed to map pixel buffer for upload";
+            f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return;
+        }
+    }
+
+    f->glBindTexture(GL_TEXTURE_2D, job.textureId);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    if (job.reallocate)
+        f->glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.width(), image.height(), 0,
+                        format, GL_UNSIGNED_BYTE, nullptr);
+
+    if (mapped) {
+        int offset = 0;
+        for (const QRect &rect : job.rects) {
+            copyPixels(mapped + offset, image, rect);
+            offset += rect.width() * rect.height() * 4;
+        }
+        ef->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    int offset = 0;
+    for (const QRect &rect : job.rects) {
+        const void *pixels;
+        if (mapped) {
+            pixels = reinterpret_cast<const void *>(quintptr(offset));
+            offset += rect.width() * rect.height() * 4;
+        } else if (!swizzle && rect.left() == 0 && rect.width() == image.width()
+                   && image.bytesPerLine() == rect.width() * 4) {
+            pixels = image.constScanLine(rect.top());
+        } else {
+            m_scratch.resize(rect.width() * rect.height() * 4);
+            copyPixels(reinterpret_cast<uchar *>(m_scratch.data()), image, rect);
+            pixels = m_scratch.constData();
+        }
+
+        f->glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x(), rect.y(), rect.width(), rect.height(),
+                           format, GL_UNSIGNED_BYTE, pixels);
+    }
+
+    f->glBindTexture(GL_TEXTURE_2D, 0);
+
+    if (pbo)
+        f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// Copies rect of image tightly packed into dst, swapping red and blue when
+// the context can't take BGRA data directly.
+void TextureUploader::copyPixels(uchar *dst, const QImage &image, const QRect &rect) const
+{
+    const bool swizzle = !m_bgra && isBgraFormat(image.format());
+    const int rowBytes = rect.width() * 4;
+
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        const uchar *src = image.constScanLine(y) + rect.left() * 4;
+        if (swizzle) {
+            const quint32 *s = reinterpret_cast<const quint32 *>(src);
+            quint32 *d = reinterpret_cast<quint32 *>(dst);
+            for (int x = 0; x < rect.width(); x++) {
+                const quint32 p = s[x];
+                d[x] = (p & 0xff00ff00) | ((p & 0x00ff0000) >> 16) | ((p & 0x000000ff) << 16);
+            }
+        } else {
+            memcpy(dst, src, rowBytes);
+        }
+        dst += rowBytes;
+    }
+}
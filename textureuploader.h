@@ -0,0 +1,128 @@
+#ifndef TEXTUREUPLOADER_H
+#define TEXTUREUPLOADER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QImage>
+#include <QList>
+#include <QVector>
+#include <QRegion>
+#include <QByteArray>
+#include <QOpenGLExtraFunctions>
+#include <QtWaylandCompositor/QWaylandBufferRef>
+
+class QOpenGLContext;
+class QOffscreenSurface;
+class QWaylandCompositor;
+struct wl_shm_pool;
+class TextureUploader;
+
+// Compositor-owned copy of a wl_shm buffer. It keeps two textures: the
+// front one is sampled while painting, the back one receives the next
+// upload and becomes the front once the upload has completed on the GPU.
+// Textures persist across buffers, so only damaged areas are uploaded,
+// plus whatever the back texture missed while it was the front one.
+class ShmTexture
+{
+public:
+    GLuint textureId() const { return m_front >= 0 ? m_textures[m_front] : 0; }
+    QSize size() const { return m_front >= 0 ? m_sizes[m_front] : QSize(); }
+    bool isUploading() const { return m_uploading; }
+    // Client buffers this texture keeps from being released
+    int buffersHeld() const;
+
+    // To be called by the owner instead of deleting. The textures are
+    // freed by the uploader once no upload refers to them any more.
+    void release() { m_released = true; }
+
+private:
+    friend class TextureUploader;
+    ShmTexture();
+
+    GLuint m_textures[2];
+    QSize m_sizes[2];
+    QImage::Format m_formats[2];
+    QRegion m_stale[2];
+    int m_front;
+    bool m_uploading;
+    bool m_released;
+    QWaylandBufferRef m_uploadingBuffer;
+    QWaylandBufferRef m_queuedBuffer;
+    QRegion m_queuedDamage;
+};
+
+// Moves wl_shm buffer uploads off the GUI thread.
+//
+// Pixels are copied into alternating pixel buffer objects and transferred
+// into textures by a worker thread that owns a context sharing objects with
+// the output's context. Every upload is followed by a fence, and textures
+// only become visible to the painting code once their fence has signaled.
+// When the context can't do this, uploads happen synchronously instead.
+//
+// As soon as an upload is complete the client buffer is released, so that
+// clients can get away with two buffers instead of three.
+class TextureUploader : public QThread
+{
+    Q_OBJECT
+public:
+    explicit TextureUploader(QWaylandCompositor *compositor, QObject *parent = nullptr);
+    ~TextureUploader();
+
+    // Must be called with shareContext current
+    void create(QOpenGLContext *shareContext);
+    bool isAsynchronous() const { return m_context != nullptr; }
+
+    // The functions below must be called on the GUI thread with the share
+    // context current.
+    ShmTexture *createTexture();
+    // attached tells whether any of the commits since the last upload
+    // attached a buffer. Those that didn't have nothing new to upload.
+    void upload(ShmTexture *texture, const QWaylandBufferRef &buffer, const QRegion &damage, bool attached);
+    void collect();
+
+    // Bytes of pixel data submitted since the last call
+    quint64 takeUploadedBytes();
+
+signals:
+    void uploadFinished();
+
+protected:
+    void run() override;
+
+private:
+    struct Job {
+        ShmTexture *texture;
+        GLuint textureId;
+        QImage image;
+        QVector<QRect> rects;
+        wl_shm_pool *pool;
+        bool reallocate;
+        GLsync fence;
+    };
+
+    void submit(ShmTexture *texture);
+    void finish(Job &job);
+    void uploadImage(QOpenGLFunctions *f, QOpenGLExtraFunctions *ef, const Job &job, GLuint pbo);
+    void copyPixels(uchar *dst, const QImage &image, const QRect &rect) const;
+    void stop();
+    void releaseBuffer(const QWaylandBufferRef &buffer);
+
+    QWaylandCompositor *m_compositor;
+    QOpenGLContext *m_context;
+    QOffscreenSurface *m_surface;
+    bool m_bgra;
+    GLenum m_bgraInternalFormat;
+    QByteArray m_scratch;
+    quint64 m_uploadedBytes;
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QList<Job> m_jobs;
+    QList<Job> m_finished;
+    QList<Job> m_waiting;
+    QList<ShmTexture*> m_textures;
+    bool m_quit;
+};
+
+#endif // TEXTUREUPLOADER_H
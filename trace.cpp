@@ -0,0 +1,165 @@
+#include "trace.h"
+#include "frameclock.h"
+
+#include <QCoreApplication>
+#include <QThread>
+#include <QMutex>
+#include <QVector>
+#include <QJsonArray>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Trace {
+
+// Records kept per thread, a power of two
+static const quint32 ringSize = 8192;
+
+struct Buffer {
+    Record records[ringSize];
+    // Records ever written. Only the owning thread stores it.
+    QAtomicInteger<quint32> written;
+    qint64 tid;
+    QString name;
+};
+
+QBasicAtomicInt enabled = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+// Buffers are never freed, so records of threads that have finished can
+// still be dumped. Threads are few and long-lived here.
+static QMutex buffersMutex;
+static QVector<Buffer *> buffers;
+static thread_local Buffer *threadBuffer = nullptr;
+
+static Buffer *createBuffer()
+{
+    Buffer *buffer = new Buffer;
+    buffer->written.store(0);
+    buffer->tid = syscall(SYS_gettid);
+
+    QThread *thread = QThread::currentThread();
+    if (QCoreApplication::instance() && thread == QCoreApplication::instance()->thread())
+        buffer->name = QStringLiteral("main");
+    else if (!thread->objectName().isEmpty())
+        buffer->name = thread->objectName();
+    else
+        buffer->name = QStringLiteral("thread %1").arg(buffer->tid);
+
+    QMutexLocker locker(&buffersMutex);
+    buffers.append(buffer);
+    return buffer;
+}
+
+void setEnabled(bool enable)
+{
+    enabled.store(enable);
+}
+
+void record(Category category, Phase phase, const char *name, qint64 value)
+{
+    Buffer *buffer = threadBuffer;
+    if (!buffer)
+        buffer = threadBuffer = createBuffer();
+
+    const quint32 sequence = buffer->written.load();
+    Record &record = buffer->records[sequence & (ringSize - 1)];
+    record.timestamp = FrameClock::now();
+    record.name = name;
+    record.value = value;
+    record.category = category;
+    record.phase = phase;
+    buffer->written.storeRelease(sequence + 1);
+}
+
+static const char *categoryName(quint32 category)
+{
+    switch (category) {
+    case Frame: return "frame";
+    case Surface: return "surface";
+    case Input: return "input";
+    case Upload: return "upload";
+    case Control: return "control";
+    }
+    return "unknown";
+}
+
+// Copies a buffer while its thread may keep writing. Records overwritten
+// during the copy, including the one possibly being written when it
+// ended, are left out.
+static QVector<Record> snapshot(const Buffer *buffer)
+{
+    const quint32 written = buffer->written.loadAcquire();
+    const quint32 first = written > ringSize ? written - ringSize : 0;
+
+    QVector<Record> records;
+    records.reserve(int(written - first));
+    for (quint32 i = first; i < written; i++)
+        records.append(buffer->records[i & (ringSize - 1)]);
+
+    const quint32 after = buffer->written.loadAcquire();
+    const quint32 valid = after >= ringSize ? after - ringSize + 1 : 0;
+    if (valid > first)
+        records.remove(0, qMin(int(valid - first), records.count()));
+
+    return records;
+}
+
+QJsonObject dump()
+{
+    const double pid = getpid();
+    QJsonArray events;
+
+    QMutexLocker locker(&buffersMutex);
+    for (const Buffer *buffer : qAsConst(buffers)) {
+        QJsonObject threadName;
+        threadName["name"] = QStringLiteral("thread_name");
+        threadName["ph"] = QStringLiteral("M");
+        threadName["pid"] = pid;
+        threadName["tid"] = double(buffer->tid);
+        QJsonObject threadArgs;
+        threadArgs["name"] = buffer->name;
+        threadName["args"] = threadArgs;
+        events.append(threadName);
+
+        const QVector<Record> records = snapshot(buffer);
+        for (const Record &record : records) {
+            QJsonObject event;
+            event["name"] = QLatin1String(record.name);
+            event["cat"] = QLatin1String(categoryName(record.category));
+            event["ts"] = double(record.timestamp) / 1000;
+            event["pid"] = pid;
+            event["tid"] = double(buffer->tid);
+
+            QJsonObject args;
+            switch (record.phase) {
+            case Begin:
+                event["ph"] = QStringLiteral("B");
+                args["value"] = double(record.value);
+                break;
+            case End:
+                event["ph"] = QStringLiteral("E");
+                break;
+            case Instant:
+                event["ph"] = QStringLiteral("i");
+                event["s"] = QStringLiteral("t");
+                args["value"] = double(record.value);
+                break;
+            case Counter:
+                event["ph"] = QStringLiteral("C");
+                args[QLatin1String(record.name)] = double(record.value);
+                break;
+            }
+            if (!args.isEmpty())
+                event["args"] = args;
+
+            events.append(event);
+        }
+    }
+
+    QJsonObject trace;
+    trace["traceEvents"] = events;
+    trace["displayTimeUnit"] = QStringLiteral("ms");
+    return trace;
+}
+
+}
@@ -0,0 +1,111 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QtGlobal>
+#include <QAtomicInt>
+#include <QJsonObject>
+
+// Low-overhead event tracing.
+//
+// Each thread records into a ring buffer of its own, so recording takes
+// no lock: a clock read and one fixed-size record written in place. Names
+// must be string literals, only their pointers are stored. The newest
+// records of all threads can be dumped in the Chrome trace event format,
+// which Perfetto and chrome://tracing both load.
+//
+// Categories left out of NUBBOCK_TRACE_CATEGORIES at build time compile
+// to nothing. The others cost a single branch while tracing is stopped.
+namespace Trace {
+
+enum Category : quint32 {
+    Frame = 0x01,
+    Surface = 0x02,
+    Input = 0x04,
+    Upload = 0x08,
+    Control = 0x10
+};
+
+enum Phase : quint8 {
+    Begin,
+    End,
+    Instant,
+    Counter
+};
+
+struct Record {
+    qint64 timestamp;
+    const char *name;
+    qint64 value;
+    quint32 category;
+    Phase phase;
+};
+
+extern QBasicAtomicInt enabled;
+
+void setEnabled(bool enable);
+inline bool isEnabled() { return enabled.load(); }
+
+void record(Category category, Phase phase, const char *name, qint64 value);
+QJsonObject dump();
+
+template <bool Compiled>
+class Scope
+{
+public:
+    Scope(Category category, const char *name, qint64 value = 0)
+        : m_category(category)
+        , m_name(name)
+        , m_active(isEnabled())
+    {
+        if (m_active)
+            record(category, Begin, name, value);
+    }
+
+    ~Scope()
+    {
+        if (m_active)
+            record(m_category, End, m_name, 0);
+    }
+
+private:
+    Category m_category;
+    const char *m_name;
+    bool m_active;
+};
+
+template <>
+class Scope<false>
+{
+public:
+    Scope(Category, const char *, qint64 = 0) {}
+};
+
+}
+
+#ifndef NUBBOCK_TRACE_CATEGORIES
+#define NUBBOCK_TRACE_CATEGORIES 0xffffffff
+#endif
+
+#define TRACE_COMPILED(category) ((NUBBOCK_TRACE_CATEGORIES & Trace::category) != 0)
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Records a begin event now and the matching end event when the
+// enclosing block is left
+#define TRACE_SCOPE(category, name, ...) \
+    Trace::Scope<TRACE_COMPILED(category)> TRACE_CONCAT(traceScope, __LINE__)(Trace::category, name, ##__VA_ARGS__)
+
+#define TRACE_INSTANT(category, name, value) \
+    do { \
+        if (TRACE_COMPILED(category) && Trace::isEnabled()) \
+            Trace::record(Trace::category, Trace::Instant, name, value); \
+    } while (0)
+
+#define TRACE_COUNTER(category, name, value) \
+    do { \
+        if (TRACE_COMPILED(category) && Trace::isEnabled()) \
+            Trace::record(Trace::category, Trace::Counter, name, value); \
+    } while (0)
+
+#endif // TRACE_H
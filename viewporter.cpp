@@ -0,0 +1,140 @@
+#include "viewporter.h"
+#include "compositor.h"
+
+#include <QtWaylandCompositor/QWaylandSurface>
+
+Viewporter::Viewporter(Compositor *compositor)
+    : QObject(compositor)
+    , QtWaylandServer::wp_viewporter(compositor->display(), 1)
+    , m_compositor(compositor)
+{
+}
+
+void Viewporter::wp_viewporter_destroy(Resource *resource)
+{
+    wl_resource_destroy(resource->handle);
+}
+
+void Viewporter::wp_viewporter_get_viewport(Resource *resource, uint32_t id, struct ::wl_resource *surfaceResource)
+{
+    QWaylandSurface *surface = QWaylandSurface::fromResource(surfaceResource);
+    if (m_viewports.contains(surface)) {
+        wl_resource_post_error(resource->handle, error_viewport_exists, "the surface already has a viewport");
+        return;
+    }
+
+    m_viewports.insert(surface, new Viewport(this, surface, resource->client(), id));
+}
+
+Viewport::Viewport(Viewporter *viewporter, QWaylandSurface *surface, struct ::wl_client *client, uint32_t id)
+    : QObject(viewporter)
+    , QtWaylandServer::wp_viewport(client, id, 1)
+    , m_viewporter(viewporter)
+    , m_surface(surface)
+    , m_resourceDestroyed(false)
+{
+    connect(surface, &QWaylandSurface::redraw, this, &Viewport::commit);
+    connect(surface, &QWaylandSurface::surfaceDestroyed, this, &Viewport::surfaceDestroyed);
+}
+
+void Viewport::wp_viewport_destroy_resource(Resource *)
+{
+    m_resourceDestroyed = true;
+    m_source = QRectF();
+    m_destination = QSize();
+
+    if (!m_surface) {
+        deleteLater();
+        return;
+    }
+
+    m_viewporter->m_viewports.remove(m_surface);
+}
+
+void Viewport::wp_viewport_destroy(Resource *resource)
+{
+    wl_resource_destroy(resource->handle);
+}
+
+void Viewport::wp_viewport_set_source(Resource *resource, wl_fixed_t x, wl_fixed_t y,
+                                      wl_fixed_t width, wl_fixed_t height)
+{
+    if (!m_surface) {
+        wl_resource_post_error(resource->handle, error_no_surface, "the surface was destroyed");
+        return;
+    }
+
+    const QRectF source(wl_fixed_to_double(x), wl_fixed_to_double(y),
+                        wl_fixed_to_double(width), wl_fixed_to_double(height));
+    const QRectF unset(-1, -1, -1, -1);
+    if (source == unset) {
+        m_source = QRectF();
+        return;
+    }
+
+    if (source.x() < 0 || source.y() < 0 || source.width() <= 0 || source.height() <= 0) {
+        wl_resource_post_error(resource->handle, error_bad_value, "invalid source rectangle");
+        return;
+    }
+
+    m_source = source;
+}
+
+void Viewport::wp_viewport_set_destination(Resource *resource, int32_t width, int32_t height)
+{
+    if (!m_surface) {
+        wl_resource_post_error(resource->handle, error_no_surface, "the surface was destroyed");
+        return;
+    }
+
+    if (width == -1 && height == -1) {
+        m_destination = QSize();
+        return;
+    }
+
+    if (width <= 0 || height <= 0) {
+        wl_resource_post_error(resource->handle, error_bad_value, "invalid destination size");
+        return;
+    }
+
+    m_destination = QSize(width, height);
+}
+
+// Pending state is checked against the buffer just committed. Without a
+// buffer, there is nothing to check against yet.
+void Viewport::commit()
+{
+    if (!m_resourceDestroyed && m_surface->hasContent()) {
+        if (!m_destination.isValid() && !m_source.isNull()
+                && (m_source.width() != qRound(m_source.width()) || m_source.height() != qRound(m_source.height()))) {
+            wl_resource_post_error(resource()->handle, error_bad_size,
+                                   "source size is not integer and there is no destination size");
+            return;
+        }
+
+        if (!m_source.isNull() && !QRectF(QPointF(), m_surface->size()).contains(m_source)) {
+            wl_resource_post_error(resource()->handle, error_out_of_buffer,
+                                   "source rectangle extends outside of the buffer");
+            return;
+        }
+    }
+
+    if (View *view = m_viewporter->m_compositor->findView(m_surface))
+        view->setViewport(m_source, m_destination);
+
+    if (m_resourceDestroyed) {
+        m_surface->disconnect(this);
+        m_surface = nullptr;
+        deleteLater();
+    }
+}
+
+void Viewport::surfaceDestroyed()
+{
+    if (!m_resourceDestroyed)
+        m_viewporter->m_viewports.remove(m_surface);
+    m_surface = nullptr;
+
+    if (m_resourceDestroyed)
+        deleteLater();
+}
@@ -0,0 +1,65 @@
+#ifndef VIEWPORTER_H
+#define VIEWPORTER_H
+
+#include <QObject>
+#include <QHash>
+#include <QRectF>
+#include <QSize>
+#include "qwayland-server-viewporter.h"
+
+class QWaylandSurface;
+class Compositor;
+class Viewport;
+
+// The wp_viewporter global.
+//
+// Clients crop and scale their buffers through the viewport of a
+// surface. The result is applied to the surface's view on commit, and
+// taken into account wherever the view's size matters: drawing, damage,
+// culling and hit-testing.
+class Viewporter : public QObject, public QtWaylandServer::wp_viewporter
+{
+    Q_OBJECT
+public:
+    explicit Viewporter(Compositor *compositor);
+
+protected:
+    void wp_viewporter_destroy(Resource *resource) override;
+    void wp_viewporter_get_viewport(Resource *resource, uint32_t id, struct ::wl_resource *surface) override;
+
+private:
+    friend class Viewport;
+
+    Compositor *m_compositor;
+    // Surfaces with a viewport object the client still has
+    QHash<QWaylandSurface *, Viewport *> m_viewports;
+};
+
+// The wp_viewport of a surface. Outlives its resource until the next
+// commit of the surface, which unsets cropping and scaling again.
+class Viewport : public QObject, public QtWaylandServer::wp_viewport
+{
+    Q_OBJECT
+public:
+    Viewport(Viewporter *viewporter, QWaylandSurface *surface, struct ::wl_client *client, uint32_t id);
+
+protected:
+    void wp_viewport_destroy_resource(Resource *resource) override;
+    void wp_viewport_destroy(Resource *resource) override;
+    void wp_viewport_set_source(Resource *resource, wl_fixed_t x, wl_fixed_t y,
+                                wl_fixed_t width, wl_fixed_t height) override;
+    void wp_viewport_set_destination(Resource *resource, int32_t width, int32_t height) override;
+
+private:
+    void commit();
+    void surfaceDestroyed();
+
+    Viewporter *m_viewporter;
+    QWaylandSurface *m_surface;
+    bool m_resourceDestroyed;
+    // Pending state, null when unset
+    QRectF m_source;
+    QSize m_destination;
+};
+
+#endif // VIEWPORTER_H
@@ -59,14 +59,53 @@
 #include <QDebug>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QLoggingCategory>
+#include <QSet>
+#include <QFile>
+#include <QVarLengthArray>
 
 #include "compositor.h"
+#include "trace.h"
 #include <QtWaylandCompositor/qwaylandseat.h>
+#include <QtWaylandCompositor/QWaylandClient>
+
+#define MESA_EGL_NO_X11_HEADERS
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#ifndef EGL_BUFFER_AGE_EXT
+#define EGL_BUFFER_AGE_EXT 0x313D
+#endif
+
+Q_LOGGING_CATEGORY(lcDamage, "nubbock.damage")
+Q_LOGGING_CATEGORY(lcCulling, "nubbock.culling")
+Q_LOGGING_CATEGORY(lcRender, "nubbock.render")
+Q_LOGGING_CATEGORY(lcUpload, "nubbock.upload")
+
+// Number of previous frames whose damage is remembered for buffer age
+static const int maxBufferAge = 4;
 
 Window::Window(QWaylandOutput::Transform transform)
     : m_backgroundTexture(0)
+    , m_uploader(nullptr)
+    , m_evdevInput(nullptr)
     , m_compositor(0)
     , transform(transform)
+    , suspended(false)
+    , m_compositingStopped(false)
+    , m_releaseOnSuspend(qEnvironmentVariableIsSet("NUBBOCK_SUSPEND_RELEASE"))
+    , m_rendersSkipped(0)
+    , m_bufferAgeSupported(false)
+    , m_fullRepaint(true)
+    , m_repaintedPixels(0)
+    , m_culledViews(0)
+    , m_pendingMouseMove(QEvent::MouseMove, QPointF(), Qt::NoButton, Qt::NoButton, Qt::NoModifier)
+    , m_mouseMovePending(false)
+    , m_pendingTouchUpdate(QEvent::TouchUpdate)
+    , m_touchUpdatePending(false)
+    , m_motionEvents(0)
+    , m_motionEventsDelivered(0)
     , transformAnimationTimer()
     , suspendAnimationTimer()
 {
@@ -82,168 +121,510 @@ Window::Window(QWaylandOutput::Transform transform)
     timer->start(5000);
 #endif
 
-    socketServer = new SocketServer("/run/nubbock/socket", this);
+    QString socketPath = QString::fromLocal8Bit(qgetenv("NUBBOCK_SOCKET"));
+    if (socketPath.isEmpty())
+        socketPath = QStringLiteral("/run/nubbock/socket");
+    socketServer = new SocketServer(socketPath, this);
 
-    QObject::connect(socketServer, &SocketServer::jsonReceived, [this](const QJsonObject &obj) {
-        const QString transform = obj["transform"].toString();
-        if (!transform.isEmpty()) {
-            qInfo() << "Transformation change started:" << transform;
+    QObject::connect(socketServer, &SocketServer::commandReceived, [this](const ControlCommand &command, QJsonObject *reply) {
+        handleCommand(command, reply);
+    });
 
-            if (transform == "90")
-                setTransform(QWaylandOutput::Transform90);
+    socketServer->start();
+}
 
-            if (transform == "270")
-                setTransform(QWaylandOutput::Transform270);
-        }
+void Window::handleCommand(const ControlCommand &command, QJsonObject *reply)
+{
+    typedef void (Window::*CommandHandler)(qint32 value, QJsonObject *reply);
+    static const CommandHandler handlers[ControlCommand::TypeCount] = {
+        nullptr,
+        &Window::transformCommand,
+        &Window::suspendedCommand,
+        &Window::queryStatsCommand,
+        &Window::traceCommand
+    };
+
+    TRACE_SCOPE(Control, "command", command.type);
+
+    const CommandHandler handler = handlers[command.type];
+    if (handler)
+        (this->*handler)(command.value, reply);
+}
 
-        if (obj.contains("obj")) {
-            const bool suspended = obj["suspended"].toBool();
-            setSuspended(suspended);
-        }
-    });
+void Window::transformCommand(qint32 value, QJsonObject *)
+{
+    qInfo() << "Transformation change started:" << value;
 
-    socketServer->start();
+    if (value == 90)
+        setTransform(QWaylandOutput::Transform90);
+
+    if (value == 270)
+        setTransform(QWaylandOutput::Transform270);
+}
+
+void Window::suspendedCommand(qint32 value, QJsonObject *)
+{
+    setSuspended(value != 0);
+}
+
+// Resident and peak resident set size in KiB, from /proc
+static QJsonObject memoryUsage()
+{
+    QJsonObject memory;
+    QFile status(QStringLiteral("/proc/self/status"));
+    if (!status.open(QIODevice::ReadOnly))
+        return memory;
+
+    const QList<QByteArray> lines = status.readAll().split('\n');
+    for (const QByteArray &line : lines) {
+        const QList<QByteArray> fields = line.simplified().split(' ');
+        if (fields.count() < 2)
+            continue;
+        if (fields.at(0) == "VmRSS:")
+            memory["rss"] = fields.at(1).toDouble();
+        else if (fields.at(0) == "VmHWM:")
+            memory["peak"] = fields.at(1).toDouble();
+    }
+
+    return memory;
+}
+
+void Window::queryStatsCommand(qint32 value, QJsonObject *reply)
+{
+    QJsonObject stats = m_stats.toJson();
+    stats["missedFrames"] = m_compositor->frameClock()->missedFrames();
+    stats["repaintedPixels"] = double(m_repaintedPixels);
+    stats["culledViews"] = m_culledViews;
+    stats["throttledSurfaces"] = m_compositor->throttledSurfaces();
+
+    QJsonObject socket;
+    socket["connections"] = socketServer->connectionCount();
+    socket["messages"] = double(socketServer->messagesReceived());
+    socket["errors"] = double(socketServer->errors());
+    stats["socket"] = socket;
+
+    QJsonObject views;
+    views["allocated"] = double(m_compositor->viewsAllocated());
+    views["reused"] = double(m_compositor->viewsReused());
+    views["live"] = m_compositor->viewCount();
+    stats["views"] = views;
+
+    QJsonObject buffersHeld;
+    const QHash<QWaylandClient*, int> held = m_compositor->buffersHeld();
+    for (auto it = held.constBegin(); it != held.constEnd(); ++it)
+        buffersHeld[QString::number(it.key()->processId())] = it.value();
+    stats["buffersHeld"] = buffersHeld;
+
+    QJsonObject input;
+    input["motionEvents"] = double(m_motionEvents);
+    input["motionEventsDelivered"] = double(m_motionEventsDelivered);
+    input["touchGrabs"] = m_touchGrabs.count();
+    stats["input"] = input;
+
+    stats["memory"] = memoryUsage();
+
+    QJsonObject suspend;
+    suspend["suspended"] = m_compositingStopped;
+    suspend["rendersSkipped"] = double(m_rendersSkipped);
+    stats["suspend"] = suspend;
+    reply->insert("stats", stats);
+
+    if (value)
+        m_stats.reset();
+}
+
+void Window::traceCommand(qint32 value, QJsonObject *reply)
+{
+    switch (value) {
+    case ControlCommand::TraceStop:
+        Trace::setEnabled(false);
+        break;
+    case ControlCommand::TraceStart:
+        Trace::setEnabled(true);
+        break;
+    case ControlCommand::TraceDump:
+        reply->insert("trace", Trace::dump());
+        break;
+    }
 }
 
 void Window::setCompositor(Compositor *comp) {
     m_compositor = comp;
+
+    // Views are reused, so a guarded pointer alone won't notice
+    QObject::connect(m_compositor, &Compositor::viewRemoved, this, [this](View *view) {
+        if (m_mouseView == view)
+            m_mouseView = nullptr;
+
+        for (auto it = m_touchGrabs.begin(); it != m_touchGrabs.end(); ) {
+            if (it.value() == view)
+                it = m_touchGrabs.erase(it);
+            else
+                ++it;
+        }
+    });
 }
 
 void Window::initializeGL()
 {
-    QString backgroundImagePath =  QString::fromLocal8Bit(qgetenv("NUBBOCK_BACKGROUND_IMAGE"));
+    m_backgroundImagePath = QString::fromLocal8Bit(qgetenv("NUBBOCK_BACKGROUND_IMAGE"));
+    loadBackground();
 
-    if (!backgroundImagePath.isEmpty()) {
-        QImage backgroundImage = QImage(backgroundImagePath);
-        m_backgroundTexture = new QOpenGLTexture(backgroundImage, QOpenGLTexture::DontGenerateMipMaps);
-        m_backgroundTexture->setMinificationFilter(QOpenGLTexture::Nearest);
-        m_backgroundImageSize = backgroundImage.size();
-    }
-
-    QImage black(size(), QImage::Format_Mono);
-    black.setColor(0, qRgb(0, 0, 0));
-    black.fill(0);
+    // The overlays are a single black texel stretched over the output
+    QImage black(1, 1, QImage::Format_RGB32);
+    black.fill(Qt::black);
 
-    transformOverlayTexture = new QOpenGLTexture(black, QOpenGLTexture::DontGenerateMipMaps);
-    suspendOverlayTexture = new QOpenGLTexture(black, QOpenGLTexture::DontGenerateMipMaps);
+    m_overlayTexture = new QOpenGLTexture(black, QOpenGLTexture::DontGenerateMipMaps);
 
     transformAnimationOpacity = 0.0f;
     suspendAnimationOpacity = 0.0f;
 
-    m_textureBlitter.create();
-    transformOverlayBlitter.create();
-    suspendOverlayBlitter.create();
-}
+    m_renderer.create();
 
-void Window::paintGL()
-{
-    m_compositor->startRender();
-    QOpenGLFunctions *functions = context()->functions();
-    functions->glClearColor(.0f, .165f, .31f, 0.5f);
-    functions->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    m_uploader = new TextureUploader(m_compositor, this);
+    m_uploader->create(context());
+    QObject::connect(m_uploader, &TextureUploader::uploadFinished, this, [this]() {
+        m_compositor->triggerRender();
+    });
+
+    QObject::connect(m_compositor->frameClock(), &FrameClock::renderRequested, this, [this]() {
+        // Motion alone is no reason to paint, only what delivering it
+        // changed on screen, such as the cursor
+        flushMotion();
+        if (!m_compositor->frameClock()->isFrameRequested())
+            return;
+        if (m_compositingStopped) {
+            m_rendersSkipped++;
+            return;
+        }
+        update();
+    });
+    QObject::connect(this, &QOpenGLWindow::frameSwapped, this, [this]() {
+        if (m_compositingStopped)
+            return;
 
-    m_textureBlitter.bind();
+        m_compositor->framePresented();
+        if (m_compositor->frameClock()->lastCommitLatency())
+            m_stats.record(FrameStats::CommitLatency, m_compositor->frameClock()->lastCommitLatency());
 
-    QSize sz = size();
-    sz.transpose();
+        // The output has faded to black for good
+        if (suspended && !suspendAnimationTimer.isActive())
+            stopCompositing();
+    });
 
-    float angle;
+    const QString evdevDevices = QString::fromLocal8Bit(qgetenv("NUBBOCK_EVDEV_DEVICES"));
+    if (!evdevDevices.isEmpty() && !m_evdevInput) {
+        m_evdevInput = new EvdevInput(evdevDevices.split(':', QString::SkipEmptyParts), this);
+        m_evdevInput->setTargetSize(size());
+        QObject::connect(m_evdevInput, &EvdevInput::touchEvent, this, [this](QTouchEvent *e) {
+            touchEvent(e);
+        });
+        if (!m_evdevInput->start())
+            qWarning() << "No evdev input device could be opened";
+    }
+
+    if (!m_gpuTimer.create(context()))
+        qCDebug(lcRender) << "GPU timer queries not supported";
+
+    EGLDisplay display = eglGetCurrentDisplay();
+    if (display != EGL_NO_DISPLAY) {
+        const QByteArray extensions(eglQueryString(display, EGL_EXTENSIONS));
+        m_bufferAgeSupported = extensions.split(' ').contains("EGL_EXT_buffer_age");
+    }
+
+    qCDebug(lcDamage) << "Buffer age supported:" << m_bufferAgeSupported;
 
+    m_damageHistory.clear();
+    m_fullRepaint = true;
+}
+
+bool Window::transformAngle(float *angle) const
+{
     switch (transform) {
     case QWaylandOutput::TransformNormal:
     case QWaylandOutput::TransformFlipped:
-        angle = 0.0f;
-        break;
+        *angle = 0.0f;
+        return true;
     case QWaylandOutput::Transform90:
     case QWaylandOutput::TransformFlipped90:
-        angle = 90.0f;
-        break;
+        *angle = 90.0f;
+        return true;
     case QWaylandOutput::Transform180:
     case QWaylandOutput::TransformFlipped180:
-        angle = 180.0f;
-        break;
+        *angle = 180.0f;
+        return true;
     case QWaylandOutput::Transform270:
     case QWaylandOutput::TransformFlipped270:
-        angle = 270.0f;
-        break;
-    default:
-        qWarning() << "Unsupported transform" << transform;
-        return;
+        *angle = 270.0f;
+        return true;
     }
 
-    QMatrix4x4 targetTransform =
-            QOpenGLTextureBlitter::targetTransform(QRect(QPoint(0, 0), m_backgroundImageSize),
-                                                   QRect(QPoint(0, 0), sz));
-    targetTransform.rotate(angle, 0.0f, 0.0f, 1.0f);
+    return false;
+}
+
+// Maps a rectangle given in surface-local coordinates of a view placed at
+// geometry to window framebuffer pixels (origin bottom left), exactly the
+// way the renderer will put it on screen.
+QRect Window::mapToFramebuffer(const QTransform &transform, const QRectF &rect) const
+{
+    if (rect.isEmpty())
+        return QRect();
 
-    if (m_backgroundTexture)
-        m_textureBlitter.blit(m_backgroundTexture->textureId(),
-                              targetTransform,
-                              QOpenGLTextureBlitter::OriginTopLeft);
+    const QSize fbSize = size() * devicePixelRatio();
+    const QRectF ndc = transform.mapRect(rect);
+    const QRectF pixels((ndc.left() + 1) / 2 * fbSize.width(), (ndc.top() + 1) / 2 * fbSize.height(),
+                        ndc.width() / 2 * fbSize.width(), ndc.height() / 2 * fbSize.height());
 
-    functions->glEnable(GL_BLEND);
-    functions->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    return pixels.toAlignedRect() & QRect(QPoint(), fbSize);
+}
+
+// Gathers everything that changed on screen since the last frame: client
+// damage, views that moved, appeared or vanished, plus whatever the
+// compositor recorded on its own.
+QRegion Window::collectDamage(const QSize &viewport, float angle)
+{
+    QRegion damage = m_compositor->takeDamage();
+
+    // The cursor layer is small, so it is repainted in full whenever it
+    // moved or its content changed. This has to come first, the scene
+    // below would swallow the damage of the cursor surface otherwise.
+    View *cursor = m_compositor->cursorView();
+    const QRectF cursorGeometry = m_compositor->cursorGeometry();
+    QRect cursorRect;
+    if (!cursorGeometry.isEmpty())
+        cursorRect = mapToFramebuffer(QuadRenderer::outputTransform(cursorGeometry, viewport, angle),
+                                      QRectF(QPointF(), cursorGeometry.size()));
+
+    if (cursorRect != m_cursorPaintedRect) {
+        damage += m_cursorPaintedRect;
+        damage += cursorRect;
+        m_cursorPaintedRect = cursorRect;
+        if (cursor && !cursor->isContentPending())
+            cursor->takeDamage();
+    } else if (cursor && !cursor->isContentPending() && !cursor->takeDamage().isEmpty()) {
+        damage += cursorRect;
+    }
 
-    GLenum currentTarget = GL_TEXTURE_2D;
     Q_FOREACH (View *view, m_compositor->views()) {
-        if (view->isCursor())
+        const QTransform transform = view->outputTransform(viewport, angle);
+
+        QRect rect;
+        if (!view->isCursor() && view->isMapped())
+            rect = mapToFramebuffer(transform, QRectF(QPointF(), view->size()));
+
+        // Client damage only applies once the new content is in a texture
+        const bool pending = !rect.isEmpty() && view->isContentPending();
+
+        if (rect != view->paintedRect()) {
+            damage += view->paintedRect();
+            damage += rect;
+            view->setPaintedRect(rect);
+            if (!pending)
+                view->takeDamage();
             continue;
-        auto texture = view->getTexture();
-        if (!texture)
+        }
+
+        if (pending)
+            continue;
+
+        const QRegion surfaceDamage = view->takeDamage();
+        if (rect.isEmpty())
+            continue;
+
+        for (const QRect &r : surfaceDamage)
+            damage += mapToFramebuffer(transform, r);
+    }
+
+    return damage;
+}
+
+// Walks the views front to back and marks those that are entirely hidden
+// behind opaque surfaces or lie outside of the output.
+int Window::cullOccludedViews(const QSize &viewport, bool *backgroundVisible)
+{
+    const QRect outputRect(QPoint(), viewport);
+    const QList<View*> views = m_compositor->views();
+    QRegion covered;
+    int culled = 0;
+
+    for (int i = views.count() - 1; i >= 0; i--) {
+        View *view = views.at(i);
+        view->setCulled(false);
+
+        if (view->isCursor() || !view->isMapped())
+            continue;
+
+        const QPointF pos = view->absolutePosition();
+        const QRect geometry = QRectF(pos, view->size()).toAlignedRect();
+        if ((QRegion(geometry & outputRect) - covered).isEmpty()) {
+            view->setCulled(true);
+            culled++;
             continue;
-        if (texture->target() != currentTarget) {
-            currentTarget = texture->target();
-            m_textureBlitter.bind(currentTarget);
         }
-        QWaylandSurface *surface = view->surface();
-        if ((surface && surface->hasContent()) || view->isBufferLocked()) {
-            QSize s = view->size();
-            if (!s.isEmpty()) {
-                QPointF pos = view->position() + view->parentPosition();
-                QRectF surfaceGeometry(pos, s);
-                auto surfaceOrigin = view->textureOrigin();
-                QRectF targetRect(surfaceGeometry.topLeft(), surfaceGeometry.size());
-                QMatrix4x4 targetTransform = QOpenGLTextureBlitter::targetTransform(targetRect, QRect(QPoint(), sz));
-                targetTransform.rotate(angle, 0.0f, 0.0f, 1.0f);
-                m_textureBlitter.blit(texture->textureId(), targetTransform, surfaceOrigin);
-            }
+
+        // Opaque regions are only trusted on whole pixels, and only once
+        // there is a texture to cover things with
+        const QPoint offset = pos.toPoint();
+        if (QPointF(offset) == pos && view->textureId())
+            covered += view->opaqueRegion().translated(offset);
+    }
+
+    *backgroundVisible = !(QRegion(outputRect) - covered).isEmpty();
+    return culled;
+}
+
+int Window::bufferAge() const
+{
+    if (!m_bufferAgeSupported)
+        return 0;
+
+    EGLint age = 0;
+    if (!eglQuerySurface(eglGetCurrentDisplay(), eglGetCurrentSurface(EGL_DRAW), EGL_BUFFER_AGE_EXT, &age))
+        return 0;
+
+    return age;
+}
+
+void Window::paintGL()
+{
+    // Qt may still ask for frames while suspended, on expose
+    if (m_compositingStopped) {
+        QOpenGLFunctions *functions = context()->functions();
+        functions->glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        functions->glClear(GL_COLOR_BUFFER_BIT);
+        return;
+    }
+
+    TRACE_SCOPE(Frame, "paint");
+    const qint64 frameStart = FrameClock::now();
+    qint64 gpuTime;
+    while (m_gpuTimer.takeResult(&gpuTime))
+        m_stats.record(FrameStats::GpuTime, gpuTime);
+
+    flushMotion();
+
+    float angle;
+    if (!transformAngle(&angle)) {
+        qWarning() << "Unsupported transform" << transform;
+        return;
+    }
+
+    m_compositor->startRender();
+    m_gpuTimer.begin();
+    QOpenGLFunctions *functions = context()->functions();
+
+    QSize sz = size();
+    sz.transpose();
+
+    m_uploader->collect();
+
+    // Latch the newest buffers first, opaque regions depend on them
+    Q_FOREACH (View *view, m_compositor->views()) {
+        if (!view->isCursor())
+            view->advance();
+    }
+
+    bool backgroundVisible = true;
+    m_culledViews = cullOccludedViews(sz, &backgroundVisible);
+    qCDebug(lcCulling) << "Culled" << m_culledViews << "views, background visible:" << backgroundVisible;
+
+    const qint64 uploadStart = FrameClock::now();
+    {
+        TRACE_SCOPE(Frame, "upload");
+        Q_FOREACH (View *view, m_compositor->views()) {
+            if (!view->isCursor() && !view->isCulled() && view->isMapped())
+                view->updateTexture(m_uploader);
         }
+
+        // Only uploads anything when the cursor surface got a new buffer
+        if (View *cursor = m_compositor->cursorView())
+            cursor->updateTexture(m_uploader);
+    }
+    m_stats.record(FrameStats::UploadTime, FrameClock::now() - uploadStart);
+    qCDebug(lcUpload) << "Submitted" << m_uploader->takeUploadedBytes() << "bytes of shm buffer uploads";
+    if (lcUpload().isDebugEnabled()) {
+        const QHash<QWaylandClient*, int> held = m_compositor->buffersHeld();
+        for (auto it = held.constBegin(); it != held.constEnd(); ++it)
+            qCDebug(lcUpload) << "Client" << it.key()->processId() << "holds" << it.value() << "buffers";
     }
 
-    m_textureBlitter.release();
+    const QRect fbRect(QPoint(), size() * devicePixelRatio());
+    QRegion damage = collectDamage(sz, angle);
+    if (m_fullRepaint || transformAnimationOpacity > 0.0f || suspendAnimationOpacity > 0.0f) {
+        damage = fbRect;
+        m_fullRepaint = false;
+    }
 
-    if (transformAnimationOpacity > 0.0f) {
-        transformOverlayBlitter.bind();
-        transformOverlayBlitter.setOpacity(transformAnimationOpacity);
-        transformOverlayBlitter.blit(transformOverlayTexture->textureId(),
-                          targetTransform,
-                          QOpenGLTextureBlitter::OriginTopLeft);
-        transformOverlayBlitter.release();
+    // With buffer age, the back buffer already holds the frame from 'age'
+    // swaps ago, so only what changed since then needs to be repainted.
+    QRegion repaint = damage;
+    const int age = bufferAge();
+    if (age <= 0 || age > m_damageHistory.count() + 1) {
+        repaint = fbRect;
+    } else {
+        for (int i = 0; i < age - 1; i++)
+            repaint += m_damageHistory.at(i);
     }
 
-    if (suspendAnimationOpacity > 0.0f) {
-        suspendOverlayBlitter.bind();
-        suspendOverlayBlitter.setOpacity(suspendAnimationOpacity);
-        suspendOverlayBlitter.blit(suspendOverlayTexture->textureId(),
-                          targetTransform,
-                          QOpenGLTextureBlitter::OriginTopLeft);
-        suspendOverlayBlitter.release();
+    m_damageHistory.prepend(damage);
+    if (m_damageHistory.count() > maxBufferAge)
+        m_damageHistory.removeLast();
+
+    const QRect scissor = repaint.boundingRect() & fbRect;
+    m_repaintedPixels = quint64(scissor.width()) * scissor.height();
+    qCDebug(lcDamage) << "Repainting" << scissor << m_repaintedPixels << "pixels, buffer age" << age;
+
+    functions->glEnable(GL_SCISSOR_TEST);
+    functions->glScissor(scissor.x(), scissor.y(), scissor.width(), scissor.height());
+
+    functions->glClearColor(.0f, .165f, .31f, 0.5f);
+    functions->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    m_renderer.begin(sz, angle);
+
+    if (m_backgroundTexture && backgroundVisible)
+        m_renderer.addQuad(m_backgroundTexture->textureId(), GL_TEXTURE_2D,
+                           QRectF(QPointF(), m_backgroundImageSize),
+                           QOpenGLTextureBlitter::OriginTopLeft, false);
+
+    Q_FOREACH (View *view, m_compositor->views()) {
+        if (view->isCursor() || view->isCulled() || !view->isMapped())
+            continue;
+        m_renderer.addQuad(view->textureId(), view->textureTarget(), view->outputTransform(sz, angle),
+                           view->size(), view->textureOrigin(), !view->isOpaque(), 1.0f, view->textureRect());
+    }
+
+    View *cursor = m_compositor->cursorView();
+    const QRectF cursorGeometry = m_compositor->cursorGeometry();
+    if (!cursorGeometry.isEmpty() && cursor->textureId())
+        m_renderer.addQuad(cursor->textureId(), cursor->textureTarget(), cursorGeometry,
+                           cursor->textureOrigin(), true, 1.0f, cursor->textureRect());
+
+    // Both overlays are black, so they collapse into a single quad
+    const qreal overlayOpacity = 1 - (1 - transformAnimationOpacity) * (1 - suspendAnimationOpacity);
+    if (overlayOpacity > 0.0f)
+        m_renderer.addQuad(m_overlayTexture->textureId(), GL_TEXTURE_2D, QRectF(QPointF(), sz),
+                           QOpenGLTextureBlitter::OriginTopLeft, true, overlayOpacity);
+
+    const qint64 renderStart = FrameClock::now();
+    {
+        TRACE_SCOPE(Frame, "render");
+        m_renderer.end();
     }
+    m_stats.record(FrameStats::RenderTime, FrameClock::now() - renderStart);
+    qCDebug(lcRender) << "Rendered with" << m_renderer.drawCalls() << "draw calls and"
+                      << m_renderer.stateChanges() << "state changes";
 
-    functions->glDisable(GL_BLEND);
+    functions->glDisable(GL_SCISSOR_TEST);
 
+    m_gpuTimer.end();
     m_compositor->endRender();
+    m_stats.record(FrameStats::FrameTime, FrameClock::now() - frameStart);
 }
 
 View *Window::viewAt(const QPointF &point)
 {
-    View *ret = 0;
-    Q_FOREACH (View *view, m_compositor->views()) {
-        QRectF geom(view->position(), view->size());
-        if (geom.contains(point))
-            ret = view;
-    }
-    return ret;
+    return m_compositor->viewAt(point);
 }
 
 void Window::timerEvent(QTimerEvent *event)
@@ -283,7 +664,10 @@ void Window::timerEvent(QTimerEvent *event)
         }
     }
 
-    update();
+    // The overlays cover the whole output
+    m_fullRepaint = true;
+    if (!m_compositingStopped)
+        update();
 }
 
 void Window::setTransform(QWaylandOutput::Transform _transform)
@@ -303,12 +687,63 @@ void Window::setTransform(QWaylandOutput::Transform _transform)
 
 void Window::setSuspended(bool _suspended)
 {
-    if (suspended == _suspended)
+    const bool target = suspendAnimationTimer.isActive() ? suspendAnimationUp : suspended;
+    if (target == _suspended)
         return;
 
     suspendAnimationTimer.stop();
     suspendAnimationUp = _suspended;
     suspendAnimationTimer.start(20, this);
+
+    if (!_suspended && m_compositingStopped)
+        resumeCompositing();
+}
+
+// Once suspended, nothing is painted and frame callbacks are held back,
+// so clients waiting for them stop rendering as well.
+void Window::stopCompositing()
+{
+    TRACE_INSTANT(Frame, "suspend", 0);
+    m_compositingStopped = true;
+    m_compositor->setFrameCallbacksHeld(true);
+
+    if (m_releaseOnSuspend && m_backgroundTexture) {
+        makeCurrent();
+        delete m_backgroundTexture;
+        m_backgroundTexture = nullptr;
+        doneCurrent();
+    }
+}
+
+// The fade out starts with the very next frame, which also sends the
+// frame callbacks held back.
+void Window::resumeCompositing()
+{
+    TRACE_INSTANT(Frame, "resume", m_rendersSkipped);
+    m_compositingStopped = false;
+    m_compositor->setFrameCallbacksHeld(false);
+    m_compositor->frameClock()->discardCommits();
+    m_fullRepaint = true;
+
+    if (!m_backgroundTexture && !m_backgroundImagePath.isEmpty()) {
+        makeCurrent();
+        loadBackground();
+        doneCurrent();
+    }
+
+    m_compositor->triggerRender();
+    update();
+}
+
+void Window::loadBackground()
+{
+    if (m_backgroundImagePath.isEmpty())
+        return;
+
+    QImage backgroundImage = QImage(m_backgroundImagePath);
+    m_backgroundTexture = new QOpenGLTexture(backgroundImage, QOpenGLTexture::DontGenerateMipMaps);
+    m_backgroundTexture->setMinificationFilter(QOpenGLTexture::Nearest);
+    m_backgroundImageSize = backgroundImage.size();
 }
 
 QPointF Window::transformPosition(const QPointF p)
@@ -349,6 +784,8 @@ QPointF Window::transformPosition(const QPointF p)
 
 void Window::mousePressEvent(QMouseEvent *e)
 {
+    flushMotion();
+
     QPointF p = transformPosition(e->localPos());
 
     if (m_mouseView.isNull()) {
@@ -366,13 +803,15 @@ void Window::mousePressEvent(QMouseEvent *e)
         sendMouseEvent(&moveEvent, p, m_mouseView);
     }
 
-    qInfo() << "XXXXX" << __func__ << p;
+    TRACE_INSTANT(Input, "mousePress", e->button());
 
     sendMouseEvent(e, p, m_mouseView);
 }
 
 void Window::mouseReleaseEvent(QMouseEvent *e)
 {
+    flushMotion();
+
     QPointF p = transformPosition(e->localPos());
 
     if (e->buttons() == Qt::NoButton)
@@ -381,38 +820,97 @@ void Window::mouseReleaseEvent(QMouseEvent *e)
     sendMouseEvent(e, p, m_mouseView);
 }
 
+// Motion is held back until the frame clock fires, and only the latest
+// position is delivered then. Presses and releases go out right away,
+// after whatever motion preceded them.
 void Window::mouseMoveEvent(QMouseEvent *e)
 {
+    m_pendingMouseMove = *e;
+    m_mouseMovePending = true;
+    m_motionEvents++;
+    m_compositor->frameClock()->scheduleWakeup();
+}
+
+void Window::flushMotion()
+{
+    if (m_mouseMovePending) {
+        m_mouseMovePending = false;
+        m_motionEventsDelivered++;
+        deliverMouseMove(&m_pendingMouseMove);
+    }
+
+    if (m_touchUpdatePending) {
+        m_touchUpdatePending = false;
+        m_motionEventsDelivered++;
+        deliverTouchEvent(&m_pendingTouchUpdate);
+    }
+}
+
+void Window::deliverMouseMove(QMouseEvent *e)
+{
+    TRACE_SCOPE(Input, "mouseMove");
     QPointF p = transformPosition(e->localPos());
     View *view = m_mouseView ? m_mouseView.data() : viewAt(p);
     sendMouseEvent(e, p, view);
 }
 
+// Updates that only move touch points are coalesced like mouse motion.
+// Every event carries all current points with their latest positions, but
+// a point that moved in an earlier event and not in the latest one is
+// stationary there, so points keep their moved state across coalesced
+// events.
 void Window::touchEvent(QTouchEvent *e)
 {
-    QWaylandSeat *input = m_compositor->defaultSeat();
-
-    const QList<QTouchEvent::TouchPoint> points = e->touchPoints();
-    if (points.isEmpty())
-        return;
-
-    QPointF p = transformPosition(points.at(0).normalizedPos());
-    View *view = viewAt(p);
-
-    qInfo() << "XXXXX" << __func__ << p << view;
+    if (e->type() == QEvent::TouchUpdate
+            && !(e->touchPointStates() & (Qt::TouchPointPressed | Qt::TouchPointReleased))) {
+        QList<QTouchEvent::TouchPoint> points = e->touchPoints();
+        Qt::TouchPointStates states = e->touchPointStates();
+        if (m_touchUpdatePending) {
+            const QList<QTouchEvent::TouchPoint> pendingPoints = m_pendingTouchUpdate.touchPoints();
+            for (QTouchEvent::TouchPoint &tp : points) {
+                if (tp.state() != Qt::TouchPointStationary)
+                    continue;
+                for (const QTouchEvent::TouchPoint &pending : pendingPoints) {
+                    if (pending.id() == tp.id() && pending.state() == Qt::TouchPointMoved) {
+                        tp.setState(Qt::TouchPointMoved);
+                        states |= Qt::TouchPointMoved;
+                        break;
+                    }
+                }
+            }
+        }
 
-    if (!view)
+        m_pendingTouchUpdate = *e;
+        m_pendingTouchUpdate.setTouchPoints(points);
+        m_pendingTouchUpdate.setTouchPointStates(states);
+        m_touchUpdatePending = true;
+        m_motionEvents++;
+        m_compositor->frameClock()->scheduleWakeup();
         return;
+    }
 
-    QWaylandSurface *surface = view->surface();
+    flushMotion();
+    deliverTouchEvent(e);
+}
 
-    if (!surface) {
-        qWarning() << __func__ << "no surface?";
-        return;
-    }
+// Each touch point is hit-tested once, when it goes down. The view found
+// then holds an implicit grab on the point until it is released, so
+// points of one event may go to different surfaces.
+void Window::deliverTouchEvent(QTouchEvent *e)
+{
+    TRACE_SCOPE(Input, "touch", e->touchPoints().count());
+    const qint64 start = FrameClock::now();
+    QWaylandSeat *input = m_compositor->defaultSeat();
 
     if (e->type() == QEvent::TouchCancel) {
-        input->sendTouchCancelEvent(surface->client());
+        QSet<QWaylandClient*> clients;
+        for (View *view : qAsConst(m_touchGrabs)) {
+            if (view->surface())
+                clients.insert(view->surface()->client());
+        }
+        for (QWaylandClient *client : qAsConst(clients))
+            input->sendTouchCancelEvent(client);
+        m_touchGrabs.clear();
         return;
     }
 
@@ -420,24 +918,53 @@ void Window::touchEvent(QTouchEvent *e)
 //    if (ext && ext->postTouchEvent(event, surface))
 //        return;
 
-    for (int i = 0; i < points.count(); ++i) {
-        const QTouchEvent::TouchPoint &tp(points.at(i));
+    QVarLengthArray<QWaylandClient*, 4> clients;
+    const QList<QTouchEvent::TouchPoint> points = e->touchPoints();
+    for (const QTouchEvent::TouchPoint &tp : points) {
+        if (tp.state() == Qt::TouchPointStationary)
+            continue;
+
         const QPointF pos = transformPosition(tp.pos());
-        // Convert the local pos in the compositor window to surface-relative.
-        input->sendTouchPointEvent(surface, tp.id(), pos, tp.state());
+
+        View *view;
+        if (tp.state() == Qt::TouchPointPressed) {
+            view = viewAt(pos);
+            TRACE_INSTANT(Input, "touchDown", tp.id());
+            if (view)
+                m_touchGrabs.insert(tp.id(), view);
+        } else {
+            view = m_touchGrabs.value(tp.id());
+        }
+
+        if (tp.state() == Qt::TouchPointReleased)
+            m_touchGrabs.remove(tp.id());
+
+        QWaylandSurface *surface = view ? view->surface() : nullptr;
+        if (!surface)
+            continue;
+
+        input->sendTouchPointEvent(surface, tp.id(), pos - view->absolutePosition(), tp.state());
+        if (!clients.contains(surface->client()))
+            clients.append(surface->client());
     }
 
-    input->sendTouchFrameEvent(surface->client());
+    for (QWaylandClient *client : clients)
+        input->sendTouchFrameEvent(client);
+
+    m_stats.record(FrameStats::DispatchTime, FrameClock::now() - start);
 }
 
 void Window::sendMouseEvent(QMouseEvent *e, QPointF p, View *target)
 {
     // At this point, the mouse event is already transformed
 
+    m_compositor->setCursorPosition(p);
+
     QPointF mappedPos = e->localPos();
     if (target)
-        mappedPos -= target->position();
+        mappedPos -= target->absolutePosition();
     QMouseEvent viewEvent(e->type(), mappedPos, p, e->button(), e->buttons(), e->modifiers());
+    viewEvent.setTimestamp(e->timestamp());
     m_compositor->handleMouseEvent(target, &viewEvent);
 }
 
@@ -58,7 +58,16 @@
 #include <QBasicTimer>
 #include <QLocalServer>
 #include <QLocalSocket>
+#include <QRegion>
+#include <QVector>
+#include <QHash>
+#include <QMouseEvent>
+#include <QTouchEvent>
 #include "socketserver.h"
+#include "quadrenderer.h"
+#include "textureuploader.h"
+#include "framestats.h"
+#include "evdevinput.h"
 
 QT_BEGIN_NAMESPACE
 
@@ -91,31 +100,72 @@ protected:
 private:
     void setTransform(QWaylandOutput::Transform transform);
     void setSuspended(bool suspended);
+    void stopCompositing();
+    void resumeCompositing();
+    void loadBackground();
+
+    void handleCommand(const ControlCommand &command, QJsonObject *reply);
+    void transformCommand(qint32 value, QJsonObject *reply);
+    void suspendedCommand(qint32 value, QJsonObject *reply);
+    void queryStatsCommand(qint32 value, QJsonObject *reply);
+    void traceCommand(qint32 value, QJsonObject *reply);
 
     View *viewAt(const QPointF &point);
     void sendMouseEvent(QMouseEvent *e, QPointF p, View *target);
+    void flushMotion();
+    void deliverMouseMove(QMouseEvent *e);
+    void deliverTouchEvent(QTouchEvent *e);
 
     QPointF transformPosition(const QPointF p);
 
-    QOpenGLTextureBlitter m_textureBlitter;
+    bool transformAngle(float *angle) const;
+    QRect mapToFramebuffer(const QTransform &transform, const QRectF &rect) const;
+    QRegion collectDamage(const QSize &viewport, float angle);
+    int cullOccludedViews(const QSize &viewport, bool *backgroundVisible);
+    int bufferAge() const;
+
+    QuadRenderer m_renderer;
+    GpuTimer m_gpuTimer;
+    FrameStats m_stats;
+    TextureUploader *m_uploader;
+    EvdevInput *m_evdevInput;
+    QString m_backgroundImagePath;
     QSize m_backgroundImageSize;
     QOpenGLTexture *m_backgroundTexture;
     Compositor *m_compositor;
     QPointer<View> m_mouseView;
+    // Views holding an implicit grab on each touch point that is down
+    QHash<int, View*> m_touchGrabs;
     QSize m_initialSize;
     QPointF m_mouseOffset;
     QPointF m_initialMousePos;
     QWaylandOutput::Transform transform, transformPending;
     bool suspended;
+    // Set once the fade to black is complete, until resuming
+    bool m_compositingStopped;
+    bool m_releaseOnSuspend;
+    quint64 m_rendersSkipped;
+
+    bool m_bufferAgeSupported;
+    bool m_fullRepaint;
+    QVector<QRegion> m_damageHistory;
+    QRect m_cursorPaintedRect;
+    quint64 m_repaintedPixels;
+    int m_culledViews;
+
+    QOpenGLTexture *m_overlayTexture;
+
+    QMouseEvent m_pendingMouseMove;
+    bool m_mouseMovePending;
+    QTouchEvent m_pendingTouchUpdate;
+    bool m_touchUpdatePending;
+    quint64 m_motionEvents;
+    quint64 m_motionEventsDelivered;
 
-    QOpenGLTextureBlitter transformOverlayBlitter;
-    QOpenGLTexture *transformOverlayTexture;
     QBasicTimer transformAnimationTimer;
     qreal transformAnimationOpacity;
     bool transformAnimationUp;
 
-    QOpenGLTextureBlitter suspendOverlayBlitter;
-    QOpenGLTexture *suspendOverlayTexture;
     QBasicTimer suspendAnimationTimer;
     qreal suspendAnimationOpacity;
     bool suspendAnimationUp;